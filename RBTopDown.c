@@ -0,0 +1,349 @@
+#include "RBTopDown.h"
+
+#include <stdint.h>
+
+struct RBTDNode {
+        value_t value;
+        int red;
+        struct RBTDNode *link[2];
+};
+
+struct RBTDTree {
+        struct RBTDNode *root;
+        size_t size;
+};
+
+static int isred(const struct RBTDNode *node);
+
+static struct RBTDNode *rotate(struct RBTDNode *node, int dir);
+
+static struct RBTDNode *rotate_double(struct RBTDNode *node, int dir);
+
+static struct RBTDNode *create_node(value_t val);
+
+static void descend_left(struct RBTDCursor *cursor, struct RBTDNode *node);
+
+static int verify_balance(const struct RBTDNode *node);
+
+struct RBTDTree *rbtd_init()
+{
+        struct RBTDTree *tree = malloc(sizeof(*tree));
+        if (tree == NULL) {
+                return NULL;
+        }
+        tree->root = NULL;
+        tree->size = 0;
+        return tree;
+}
+
+int rbtd_destruct(struct RBTDTree *tree)
+{
+        if (tree == NULL) {
+                return -1;
+        }
+        // rotating left children up turns tree into list along right links
+        struct RBTDNode *node = tree->root;
+        while (node != NULL) {
+                struct RBTDNode *left_ch = node->link[0];
+                if (left_ch != NULL) {
+                        node->link[0] = left_ch->link[1];
+                        left_ch->link[1] = node;
+                        node = left_ch;
+                } else {
+                        struct RBTDNode *right_ch = node->link[1];
+                        free(node);
+                        node = right_ch;
+                }
+        }
+        free(tree);
+        return 0;
+}
+
+/* Single pass insertion. Node with two red children is recolored on the way
+ * down, and red violation, that it may cause with its parent, is fixed by
+ * rotation at grandparent. So new red leaf always gets black parent or
+ * violation, that is fixed in the same way. */
+int rbtd_insert(struct RBTDTree *tree, value_t val)
+{
+        if (tree == NULL) {
+                return -1;
+        }
+        if (tree->root == NULL) {
+                tree->root = create_node(val);
+                if (tree->root == NULL) {
+                        return -1;
+                }
+                tree->root->red = 0;
+                tree->size++;
+                return 1;
+        }
+
+        // head stands for parent of the root
+        struct RBTDNode head = {0, 0, {NULL, NULL}};
+        struct RBTDNode *great = &head;
+        struct RBTDNode *grand = NULL;
+        struct RBTDNode *parent = NULL;
+        struct RBTDNode *node = tree->root;
+        head.link[1] = tree->root;
+        int dir = 0;
+        int last = 0;
+        int retcode = 0;
+        for (;;) {
+                if (node == NULL) {
+                        node = create_node(val);
+                        if (node == NULL) {
+                                // recoloring and rotations so far kept tree valid
+                                retcode = -1;
+                                break;
+                        }
+                        parent->link[dir] = node;
+                        retcode = 1;
+                } else if (isred(node->link[0]) && isred(node->link[1])) {
+                        node->red = 1;
+                        node->link[0]->red = 0;
+                        node->link[1]->red = 0;
+                }
+                if (isred(node) && isred(parent)) {
+                        int g_dir = great->link[1] == grand;
+                        if (node == parent->link[last]) {
+                                great->link[g_dir] = rotate(grand, !last);
+                        } else {
+                                great->link[g_dir] = rotate_double(grand, !last);
+                        }
+                }
+                if (node->value == val) {
+                        break;
+                }
+                last = dir;
+                dir = node->value < val;
+                if (grand != NULL) {
+                        great = grand;
+                }
+                grand = parent;
+                parent = node;
+                node = node->link[dir];
+        }
+        tree->root = head.link[1];
+        tree->root->red = 0;
+        if (retcode == 1) {
+                tree->size++;
+        }
+        verify_balance(tree->root);
+        return retcode;
+}
+
+/* Single pass removal. Red node is pushed down along the search path,
+ * so the leaf, that is finally unlinked, is red and its removal doesn't
+ * break black heights. Value of removed node is replaced with value
+ * of its predecessor, which is unlinked instead. */
+int rbtd_remove(struct RBTDTree *tree, value_t val)
+{
+        if (tree == NULL) {
+                return -1;
+        }
+        if (tree->root == NULL) {
+                return 0;
+        }
+
+        struct RBTDNode head = {0, 0, {NULL, NULL}};
+        struct RBTDNode *grand = NULL;
+        struct RBTDNode *parent = NULL;
+        struct RBTDNode *node = &head;
+        struct RBTDNode *found = NULL;
+        head.link[1] = tree->root;
+        int dir = 1;
+        while (node->link[dir] != NULL) {
+                int last = dir;
+                grand = parent;
+                parent = node;
+                node = node->link[dir];
+                dir = node->value < val;
+                if (node->value == val) {
+                        found = node;
+                }
+                if (isred(node) || isred(node->link[dir])) {
+                        continue;
+                }
+                if (isred(node->link[!dir])) {
+                        parent->link[last] = rotate(node, dir);
+                        parent = parent->link[last];
+                        continue;
+                }
+                struct RBTDNode *sibling = parent->link[!last];
+                if (sibling == NULL) {
+                        continue;
+                }
+                if (!isred(sibling->link[0]) && !isred(sibling->link[1])) {
+                        parent->red = 0;
+                        sibling->red = 1;
+                        node->red = 1;
+                } else {
+                        int g_dir = grand->link[1] == parent;
+                        if (isred(sibling->link[last])) {
+                                grand->link[g_dir] = rotate_double(parent, last);
+                        } else {
+                                grand->link[g_dir] = rotate(parent, last);
+                        }
+                        node->red = 1;
+                        grand->link[g_dir]->red = 1;
+                        grand->link[g_dir]->link[0]->red = 0;
+                        grand->link[g_dir]->link[1]->red = 0;
+                }
+        }
+
+        if (found != NULL) {
+                found->value = node->value;
+                parent->link[parent->link[1] == node] = node->link[node->link[0] == NULL];
+                free(node);
+                tree->size--;
+        }
+        tree->root = head.link[1];
+        if (tree->root != NULL) {
+                tree->root->red = 0;
+        }
+        verify_balance(tree->root);
+        return found != NULL;
+}
+
+int rbtd_contains(const struct RBTDTree *tree, value_t val)
+{
+        if (tree == NULL) {
+                return 0;
+        }
+        const struct RBTDNode *node = tree->root;
+        while (node != NULL) {
+                if (node->value == val) {
+                        return 1;
+                }
+                node = node->link[node->value < val];
+        }
+        return 0;
+}
+
+size_t rbtd_get_size(const struct RBTDTree *tree)
+{
+        if (tree == NULL) {
+                return 0;
+        }
+        return tree->size;
+}
+
+int rbtd_cursor_seek(const struct RBTDTree *tree, value_t val,
+                     struct RBTDCursor *cursor)
+{
+        if (tree == NULL || cursor == NULL) {
+                return -1;
+        }
+        cursor->tree = tree;
+        cursor->depth = 0;
+        // nodes, where search turns left, are not less than val
+        struct RBTDNode *node = tree->root;
+        while (node != NULL) {
+                if (val <= node->value) {
+                        cursor->stack[cursor->depth++] = node;
+                        node = node->link[0];
+                } else {
+                        node = node->link[1];
+                }
+        }
+        return cursor->depth > 0;
+}
+
+int rbtd_cursor_get(const struct RBTDCursor *cursor, value_t *val)
+{
+        if (cursor == NULL || val == NULL) {
+                return -1;
+        }
+        if (cursor->depth == 0) {
+                return 0;
+        }
+        *val = cursor->stack[cursor->depth - 1]->value;
+        return 1;
+}
+
+int rbtd_cursor_next(struct RBTDCursor *cursor)
+{
+        if (cursor == NULL) {
+                return -1;
+        }
+        if (cursor->depth == 0) {
+                return 0;
+        }
+        struct RBTDNode *node = cursor->stack[--cursor->depth];
+        descend_left(cursor, node->link[1]);
+        return cursor->depth > 0;
+}
+
+// Pushes node and its chain of left descendants.
+static void descend_left(struct RBTDCursor *cursor, struct RBTDNode *node)
+{
+        while (node != NULL) {
+                assert(cursor->depth < RBTD_MAX_DEPTH);
+                cursor->stack[cursor->depth++] = node;
+                node = node->link[0];
+        }
+}
+
+static int isred(const struct RBTDNode *node)
+{
+        return node != NULL && node->red;
+}
+
+/* Rotates subtree in direction dir and returns its new root.
+ * Old root becomes red and new one becomes black. */
+static struct RBTDNode *rotate(struct RBTDNode *node, int dir)
+{
+        struct RBTDNode *pivot = node->link[!dir];
+        node->link[!dir] = pivot->link[dir];
+        pivot->link[dir] = node;
+        node->red = 1;
+        pivot->red = 0;
+        return pivot;
+}
+
+static struct RBTDNode *rotate_double(struct RBTDNode *node, int dir)
+{
+        node->link[!dir] = rotate(node->link[!dir], !dir);
+        return rotate(node, dir);
+}
+
+static struct RBTDNode *create_node(value_t val)
+{
+        struct RBTDNode *node = malloc(sizeof(*node));
+        if (node == NULL) {
+                return NULL;
+        }
+        node->value = val;
+        node->red = 1;
+        node->link[0] = NULL;
+        node->link[1] = NULL;
+        return node;
+}
+
+#ifndef NDEBUG
+
+static int verify_balance(const struct RBTDNode *node)
+{
+        if (node == NULL) {
+                return 0;
+        }
+        int l_deep = verify_balance(node->link[0]);
+        int r_deep = verify_balance(node->link[1]);
+        assert(l_deep == r_deep);
+        if (node->link[0] != NULL) {
+                assert(node->value > node->link[0]->value);
+        }
+        if (node->link[1] != NULL) {
+                assert(node->value < node->link[1]->value);
+        }
+        if (node->red) {
+                assert(!isred(node->link[0]) && !isred(node->link[1]));
+        }
+        return node->red ? l_deep : l_deep + 1;
+}
+
+#else
+
+static int verify_balance(const struct RBTDNode *node) {(void)node; return 1;}
+
+#endif
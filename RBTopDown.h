@@ -0,0 +1,123 @@
+/**
+ * @file RBTopDown.h
+ * @brief Red-black tree without parent pointers.
+ * @author Kolobaev Dmitriy
+ *
+ *
+ * This header contains user interfaces of RBTDTree class, which is
+ * red-black tree, that rebalances during single top-down pass of
+ * insertion and removal. Nodes keep no parent pointers, so they are
+ * a pointer smaller than nodes of RBTree and rotations write fewer
+ * links. Cursors walk the tree via explicit stack of ancestors.
+ * Class is linked along with RBTree and can be used instead of it,
+ * when only set operations and forward iteration are needed.
+ */
+#ifndef RBTOPDOWN_H
+#define RBTOPDOWN_H
+
+#include "RBTree.h"
+
+/// Bound of tree height, same as of RBTree.
+#define RBTD_MAX_DEPTH 128
+
+/// Red-black tree without parent pointers.
+struct RBTDTree;
+
+/// Node of RBTDTree. Fields are private.
+struct RBTDNode;
+
+/**
+ * @brief Position of value in RBTDTree.
+ *
+ * Keeps path from the root, so any insertion or removal
+ * invalidates all cursors of the tree.
+ */
+struct RBTDCursor {
+        const struct RBTDTree *tree;               ///< Tree, that cursor belongs to.
+        struct RBTDNode *stack[RBTD_MAX_DEPTH];  ///< Current node and its ancestors with greater values.
+        int depth;                                 ///< Stack size, 0 if cursor is past the end.
+};
+
+/**
+ * @brief Constructor of class RBTDTree.
+ *
+ * @return struct RBTDTree* Pointer to tree object or NULL on error.
+ * @warning Allocates memory, so pointer should be freed via rbtd_destruct().
+ */
+struct RBTDTree *rbtd_init();
+
+/**
+ * @brief Destructor of class RBTDTree.
+ *
+ * @param tree Pointer to object, that should be destroyed.
+ * @return int 0 on success, -1 on error.
+ */
+int rbtd_destruct(struct RBTDTree *tree);
+
+/**
+ * @brief Inserts value into tree.
+ *
+ * @param tree Pointer to tree object.
+ * @param val Value to insert.
+ * @return int 1 if value was inserted, 0 if it was already in tree,
+ * -1 on error.
+ */
+int rbtd_insert(struct RBTDTree *tree, value_t val);
+
+/**
+ * @brief Removes value from tree.
+ *
+ * @param tree Pointer to tree object.
+ * @param val Value to remove.
+ * @return int 1 if value was removed, 0 if it wasn't in tree, -1 on error.
+ */
+int rbtd_remove(struct RBTDTree *tree, value_t val);
+
+/**
+ * @brief Checks if value is in tree.
+ *
+ * @param tree Pointer to tree object.
+ * @param val Value to look for.
+ * @return int 1 if value is in tree, 0 otherwise.
+ */
+int rbtd_contains(const struct RBTDTree *tree, value_t val);
+
+/**
+ * @brief Gets number of values in tree.
+ *
+ * @param tree Pointer to tree object.
+ * @return size_t Number of values, 0 for NULL tree.
+ */
+size_t rbtd_get_size(const struct RBTDTree *tree);
+
+/**
+ * @brief Places cursor at the smallest value not less than val.
+ *
+ * @param tree Pointer to tree object.
+ * @param val Value to look for.
+ * @param cursor Cursor to place.
+ * @return int 1 if cursor points to value, 0 if there is no such value,
+ * -1 on error.
+ */
+int rbtd_cursor_seek(const struct RBTDTree *tree, value_t val,
+                     struct RBTDCursor *cursor);
+
+/**
+ * @brief Gets value under cursor.
+ *
+ * @param cursor Pointer to cursor.
+ * @param val Pointer to store value to.
+ * @return int 1 on success, 0 if cursor is past the end, -1 on error.
+ */
+int rbtd_cursor_get(const struct RBTDCursor *cursor, value_t *val);
+
+/**
+ * @brief Moves cursor to the next value.
+ *
+ * @param cursor Pointer to cursor.
+ * @return int 1 if cursor points to value, 0 if it went past the end,
+ * -1 on error.
+ */
+int rbtd_cursor_next(struct RBTDCursor *cursor);
+
+#endif /* RBTOPDOWN_H */
@@ -11,6 +11,8 @@
 #define RBTREE_H
 
 #include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -20,6 +22,57 @@ typedef int value_t;
 /// Red-black tree container class.
 struct RBTree;
 
+/**
+ * @brief Node of intrusive tree.
+ * 
+ * Embedded into user structures, which are linked into tree
+ * via rbt_link() without any allocations. Fields are private.
+ */
+struct RBNode {
+        value_t value;
+        int color;
+        struct RBNode *children[2];
+        struct RBNode *parent;
+};
+
+/**
+ * @brief Gets pointer to structure from pointer to its member.
+ * 
+ * @param ptr Pointer to struct RBNode member.
+ * @param type Type of enclosing structure.
+ * @param member Name of struct RBNode member in type.
+ */
+#define rbt_entry(ptr, type, member) \
+        ((type *)((char *)(ptr) - offsetof(type, member)))
+
+/**
+ * @brief Position of value in a tree.
+ * 
+ * Used to walk through values in order and as insertion hint.
+ * Cursor stays valid while other values are inserted or removed,
+ * but removal of value under cursor invalidates it.
+ */
+struct RBCursor {
+        struct RBTree *tree; ///< Tree, that cursor belongs to.
+        struct RBTree *node; ///< Current node, NULL if cursor is past the end.
+        size_t index;        ///< Position in compressed set.
+        value_t value;       ///< Current value of compressed set.
+};
+
+/**
+ * @brief Source of tree memory.
+ * 
+ * Tree header, nodes and internal buffers of the tree are allocated
+ * via alloc and released via free, both called with ctx. If free is
+ * a no-op, e.g. for arena allocator, tree may be dropped along with
+ * arena without rbt_destruct().
+ */
+struct rbt_allocator {
+        void *(*alloc)(void *ctx, size_t size); ///< Returns NULL on failure.
+        void (*free)(void *ctx, void *ptr);     ///< Never gets NULL ptr.
+        void *ctx;                              ///< User data of allocator.
+};
+
 /**
  * @brief Constructor of class RBTree.
  * 
@@ -29,6 +82,29 @@ struct RBTree;
  */
 struct RBTree *rbt_init();
 
+/**
+ * @brief Constructor of tree with given allocator.
+ * 
+ * Allocator is copied into the tree and used for all its memory
+ * until rbt_destruct(). Trees made by rbt_clone() and rbt_split() inherit
+ * allocator of the source tree.
+ * 
+ * @param alloc Allocator or NULL for default one, that uses malloc.
+ * @return struct RBTree* Pointer to tree object or NULL on error.
+ */
+struct RBTree *rbt_init_with_allocator(const struct rbt_allocator *alloc);
+
+/**
+ * @brief Makes malloc based allocator with fault injection.
+ * 
+ * Allocations fail while *fail is nonzero. In debug build default
+ * allocator is such an allocator switched by malloc_fail_enable().
+ * 
+ * @param fail Pointer to fault switch or NULL to never fail.
+ * @return struct rbt_allocator Allocator object.
+ */
+struct rbt_allocator rbt_fault_allocator(int *fail);
+
 /**
  * @brief Destructor of class RBTree.
  * 
@@ -37,15 +113,77 @@ struct RBTree *rbt_init();
  */
 int rbt_destruct(struct RBTree *tree);
 
+/**
+ * @brief Destroys tree in bounded portions.
+ * 
+ * Performs at most budget constant-time steps of tree teardown,
+ * where step either frees one node or relinks one pair of nodes.
+ * Full teardown takes linear number of steps. After the first call tree
+ * can only be passed to rbt_destruct_incremental(), rbt_destruct()
+ * or rbt_destruct_async(), that continue destruction.
+ * 
+ * @param tree Pointer to tree object.
+ * @param budget Maximum number of steps to perform.
+ * @return int 1 if tree was completely destroyed, 0 if work remains,
+ * -1 on error.
+ */
+int rbt_destruct_incremental(struct RBTree *tree, size_t budget);
+
+/**
+ * @brief Destroys tree in background thread.
+ * 
+ * Hands tree over to a detached thread, that frees it in the same way as
+ * rbt_destruct(). Returns immediately, so freeing large tree doesn't
+ * block the caller. Tree must not be used after successful call.
+ * 
+ * @param tree Pointer to tree object.
+ * @return int 0 on success, -1 on error. On error tree is left intact.
+ */
+int rbt_destruct_async(struct RBTree *tree);
+
+/**
+ * @brief Creates copy of tree.
+ * 
+ * Copies tree node for node, preserving its shape and colors,
+ * so no comparisons or rebalancing are made and copying takes linear time.
+ * 
+ * @param tree Pointer to tree object.
+ * @return struct RBTree* Pointer to new tree object or NULL on error.
+ * @warning Allocates memory, so pointer should be freed via rbt_destruct().
+ */
+struct RBTree *rbt_clone(const struct RBTree *tree);
+
 /**
  * @brief Inserts value in tree.
  * 
+ * In multiset mode inserting value, that already is in tree,
+ * increments its count.
+ * 
  * @param tree Pointer to tree object.
  * @param val Value to insert.
  * @return int 1 if value inserted, 0 if value already was in tree, -1 on error.
  */
 int rbt_insert(struct RBTree *tree, value_t val);
 
+/**
+ * @brief Inserts value in tree next to known position.
+ * 
+ * If val belongs right next to the value under hint, it is linked there
+ * without descent from the root, which takes amortized constant time.
+ * Otherwise falls back to ordinary insertion. On success hint is moved
+ * to val, so feeding sorted or nearly sorted values through one cursor
+ * makes each insertion cheap. Values greater than current maximum
+ * are appended in the same way by rbt_insert(), as well as values
+ * less than current minimum.
+ * 
+ * @param tree Pointer to tree object.
+ * @param hint Cursor of the tree or NULL. Cursor of another tree or
+ * cursor past the end is ignored and then set to val.
+ * @param val Value to insert.
+ * @return int 1 if value inserted, 0 if value already was in tree, -1 on error.
+ */
+int rbt_insert_hint(struct RBTree *tree, struct RBCursor *hint, value_t val);
+
 /**
  * @brief Checks if tree contains given value.
  * 
@@ -58,6 +196,8 @@ int rbt_contains(const struct RBTree *tree, value_t val);
 /**
  * @brief Removes value from tree
  * 
+ * In multiset mode removes one occurrence of value.
+ * 
  * @param tree Pointer to tree object.
  * @param val Value to remove
  * @return int 1 if value removed, 0 if value wasn't found in tree, -1 on error.
@@ -81,19 +221,684 @@ int rbt_remove(struct RBTree *tree, value_t val);
 int rbt_foreach(struct RBTree *tree,
                 void(*callback)(value_t, struct RBTree*, void*), void *data);
 
+/**
+ * @brief Removes all values from range [lo, hi].
+ * 
+ * Range is cut out of tree by splits and the rest is joined back,
+ * so tree is restructured in O(log n) regardless of range size.
+ * With membership filter on, cut values are counted as removed from it,
+ * which walks them when they are handed over.
+ * Cut values are either freed in bulk or handed over as a separate tree,
+ * that can be destroyed later, e.g. by rbt_destruct_async().
+ * Intrusive trees are not supported.
+ * 
+ * @param tree Pointer to tree object.
+ * @param lo Low end of range.
+ * @param hi High end of range, empty range if it is less than lo.
+ * @param cut Pointer to store tree with cut values to, NULL to free them.
+ * Tree stored to it should be freed via rbt_destruct().
+ * @return int 0 on success, -1 on error. On error tree is intact.
+ */
+int rbt_remove_range(struct RBTree *tree, value_t lo, value_t hi,
+                     struct RBTree **cut);
+
+/**
+ * @brief Gets the smallest value stored in tree.
+ * 
+ * Takes constant time, because tree caches its extreme nodes,
+ * once write buffer is merged.
+ * 
+ * @param tree Pointer to tree object.
+ * @param val Pointer to store value to.
+ * @return int 1 on success, 0 if tree is empty, -1 on error.
+ */
+int rbt_min(struct RBTree *tree, value_t *val);
+
+/**
+ * @brief Gets the largest value stored in tree.
+ * 
+ * Takes constant time, because tree caches its extreme nodes,
+ * once write buffer is merged.
+ * 
+ * @param tree Pointer to tree object.
+ * @param val Pointer to store value to.
+ * @return int 1 on success, 0 if tree is empty, -1 on error.
+ */
+int rbt_max(struct RBTree *tree, value_t *val);
+
+/**
+ * @brief Removes the smallest value from tree.
+ * 
+ * Doesn't search for value, so takes constant amortized time
+ * plus rebalancing. Lets tree serve as priority queue.
+ * 
+ * @param tree Pointer to tree object.
+ * @param val Pointer to store removed value to or NULL.
+ * @return int 1 if value removed, 0 if tree is empty, -1 on error.
+ */
+int rbt_pop_min(struct RBTree *tree, value_t *val);
+
+/**
+ * @brief Removes the largest value from tree.
+ * 
+ * Doesn't search for value, so takes constant amortized time
+ * plus rebalancing.
+ * 
+ * @param tree Pointer to tree object.
+ * @param val Pointer to store removed value to or NULL.
+ * @return int 1 if value removed, 0 if tree is empty, -1 on error.
+ */
+int rbt_pop_max(struct RBTree *tree, value_t *val);
+
+/**
+ * @brief Switches intrusive mode.
+ * 
+ * Intrusive tree consists of struct RBNode objects owned by the user,
+ * which are linked and unlinked via rbt_link() and rbt_unlink()
+ * without allocations. rbt_remove() and rbt_pop_min()/rbt_pop_max()
+ * unlink nodes without freeing, and rbt_destruct() frees only the tree
+ * object. rbt_insert(), rbt_insert_hint() and rbt_clone() are not
+ * available. Mode can be switched only on empty tree and is
+ * incompatible with multiset mode.
+ * 
+ * @param tree Pointer to tree object.
+ * @param enable Nonzero to enable intrusive mode, 0 to disable.
+ * @return int 0 on success, -1 on error or if tree is not empty.
+ */
+int rbt_set_intrusive(struct RBTree *tree, int enable);
+
+/**
+ * @brief Links user node into intrusive tree.
+ * 
+ * @param tree Pointer to tree object.
+ * @param node Pointer to node, that is not linked into any tree.
+ * @param val Value of node.
+ * @return int 1 if node linked, 0 if value already was in tree,
+ * -1 on error.
+ */
+int rbt_link(struct RBTree *tree, struct RBNode *node, value_t val);
+
+/**
+ * @brief Unlinks node from intrusive tree.
+ * 
+ * @param tree Pointer to tree object.
+ * @param node Pointer to node linked into tree.
+ * @return int 0 on success, -1 on error.
+ */
+int rbt_unlink(struct RBTree *tree, struct RBNode *node);
+
+/**
+ * @brief Finds node of intrusive tree.
+ * 
+ * @param tree Pointer to tree object.
+ * @param val Value to search for.
+ * @return struct RBNode* Node holding val or NULL if there is no such node.
+ */
+struct RBNode *rbt_find_node(const struct RBTree *tree, value_t val);
+
+/**
+ * @brief Gets node of intrusive tree under cursor.
+ * 
+ * @param cursor Pointer to cursor.
+ * @return struct RBNode* Node under cursor or NULL if cursor is past the end.
+ */
+struct RBNode *rbt_cursor_node(const struct RBCursor *cursor);
+
+/**
+ * @brief Gets value of node.
+ * 
+ * @param node Pointer to node.
+ * @return value_t Value of node.
+ */
+value_t rbt_node_value(const struct RBNode *node);
+
+/**
+ * @brief Starts or stops recording of calls on tree.
+ * 
+ * Every rbt_insert(), rbt_insert_hint(), rbt_remove() and rbt_contains()
+ * call on tree is appended to trace file as 5 byte record: op code
+ * ('i', 'r' or 'f') followed by value as native endian int32.
+ * rbt_pop_min(), rbt_pop_max(), rbt_unlink() and rbt_remove_range() are
+ * recorded as removals of values they take out, rbt_link() as insertion
+ * and rbt_join() as insertions of values of the right tree, so replay
+ * builds the same set. Records are buffered and
+ * written in batches. Trace can be replayed with timing by
+ * "./test.out -b <filename>". Recording stops when tree is destructed.
+ * 
+ * @param tree Pointer to tree object.
+ * @param filename File to record to, replacing current trace, or NULL
+ * to stop recording.
+ * @return int 0 on success, -1 on error. Writing error of the previous
+ * trace is reported when it is stopped.
+ */
+int rbt_record(struct RBTree *tree, const char *filename);
+
+/**
+ * @brief Starts or stops durability of tree.
+ * 
+ * Tree is written to snapshot file path in RBT_BINARY format, and then
+ * every successful rbt_insert(), rbt_insert_hint(), rbt_remove(),
+ * rbt_pop_min() and rbt_pop_max() is appended to log file path.log
+ * in the format of rbt_record(). Log is synced to disk after every
+ * group records, so crash loses at most group - 1 latest mutations,
+ * which rbt_sync() commits at once, e.g. when time window expires.
+ * rbt_split(), rbt_join() and rbt_remove_range() fail on durable tree.
+ * Multisets, intrusive and interval trees can't be durable.
+ * 
+ * @param tree Pointer to tree object.
+ * @param path Snapshot file, or NULL to sync and close log.
+ * @param group Number of records per sync, 1 to sync every mutation.
+ * @return int 0 on success, -1 on error. Writing error of the previous
+ * log is reported when it is closed.
+ */
+int rbt_set_durable(struct RBTree *tree, const char *path, size_t group);
+
+/**
+ * @brief Syncs logged mutations of durable tree to disk.
+ * 
+ * @param tree Pointer to tree object.
+ * @return int 0 on success, -1 on error, including earlier failed writes.
+ */
+int rbt_sync(struct RBTree *tree);
+
+/**
+ * @brief Compacts log of durable tree into snapshot.
+ * 
+ * Snapshot is replaced atomically via renaming and log is emptied,
+ * so recovery has nothing to replay.
+ * 
+ * @param tree Pointer to tree object.
+ * @return int 0 on success, -1 on error.
+ */
+int rbt_checkpoint(struct RBTree *tree);
+
+/**
+ * @brief Restores tree from snapshot and log of durable tree.
+ * 
+ * Snapshot is loaded in O(n) with its shape and the log is replayed
+ * through write buffer in sorted batches. Records cut by crash at the
+ * end of log are ignored. Restored tree is plain set, that isn't
+ * durable until rbt_set_durable() is called for it, which also
+ * compacts the log.
+ * 
+ * @param path Snapshot file given to rbt_set_durable().
+ * @return struct RBTree* Pointer to tree object or NULL on error.
+ * @warning Allocates memory, so pointer should be freed via rbt_destruct().
+ */
+struct RBTree *rbt_recover(const char *path);
+
+/**
+ * @brief Converts tree into immutable compressed set.
+ * 
+ * Values are stored in blocks of 128 as deltas, bit-packed with the width
+ * of the largest delta of block, and located via index of block first values.
+ * Dense sets take a few bits per value. rbt_contains(), rbt_count(),
+ * rbt_foreach(), rbt_min(), rbt_max(), rbt_get_size() and cursors keep
+ * working in O(log n) plus block decoding, other functions fail until
+ * rbt_decompress(). Multisets and intrusive trees can't be compressed.
+ * Cursors and nodes of the tree become invalid.
+ * 
+ * @param tree Pointer to tree object.
+ * @return int 0 on success, -1 on error. On error tree is intact.
+ */
+int rbt_compress(struct RBTree *tree);
+
+/**
+ * @brief Converts compressed set back into mutable tree.
+ * 
+ * @param tree Pointer to tree object.
+ * @return int 0 on success or if tree isn't compressed, -1 on error.
+ * On error set stays compressed.
+ */
+int rbt_decompress(struct RBTree *tree);
+
+/**
+ * @brief Switches interval mode.
+ * 
+ * In interval mode tree stores closed intervals [lo, hi] keyed by lo,
+ * so there is at most one interval with given low end. Nodes keep
+ * maximum high end of their subtree, which lets rbt_overlap_foreach()
+ * skip subtrees without overlaps. Intervals are inserted via
+ * rbt_insert_interval(), rbt_insert() fails. Other functions treat
+ * intervals as their low ends. Mode can be switched only for empty tree,
+ * that is neither multiset, intrusive nor buffered.
+ * 
+ * @param tree Pointer to tree object.
+ * @param enable Nonzero to enable interval mode, 0 to disable.
+ * @return int 0 on success, -1 on error.
+ */
+int rbt_set_interval(struct RBTree *tree, int enable);
+
+/**
+ * @brief Inserts interval into tree in interval mode.
+ * 
+ * @param tree Pointer to tree object.
+ * @param lo Low end of interval, that is its key.
+ * @param hi High end of interval, not less than lo.
+ * @return int 1 if interval was inserted, 0 if tree already has interval
+ * starting at lo, -1 on error.
+ */
+int rbt_insert_interval(struct RBTree *tree, value_t lo, value_t hi);
+
+/**
+ * @brief Applies callback to all intervals overlapping [lo, hi].
+ * 
+ * Intervals are reported in ascending order of low ends
+ * in O(log n + k) time, where k is number of reported intervals.
+ * 
+ * @param tree Pointer to tree object in interval mode.
+ * @param lo Low end of query.
+ * @param hi High end of query.
+ * @param callback Function receiving low and high ends of interval and data.
+ * @param data Pointer to pass to callback function.
+ * @return int 0 on success, -1 on error.
+ * @warning Modifying tree in callback function leads to undefined behaviour.
+ */
+int rbt_overlap_foreach(const struct RBTree *tree, value_t lo, value_t hi,
+                        void (*callback)(value_t, value_t, void*), void *data);
+
+/**
+ * @brief Switches subtree hashing.
+ * 
+ * In this mode every node keeps hash and size of its subtree. Hash of
+ * a set is sum of 64-bit hashes of its values, so equal sets have equal
+ * hashes regardless of tree shapes, and hash of any value range takes
+ * O(log n). Mode can be switched only for empty tree, that is neither
+ * multiset, intrusive nor interval tree. Hash queries merge write
+ * buffer first, so they don't take const tree.
+ * 
+ * @param tree Pointer to tree object.
+ * @param enable Nonzero to enable hashing, 0 to disable.
+ * @return int 0 on success, -1 on error.
+ */
+int rbt_set_merkle(struct RBTree *tree, int enable);
+
+/**
+ * @brief Gets hash of all values of tree with subtree hashing.
+ * 
+ * @param tree Pointer to tree object.
+ * @param hash Pointer to store hash to, 0 for empty tree.
+ * @return int 0 on success, -1 on error.
+ */
+int rbt_root_hash(struct RBTree *tree, uint64_t *hash);
+
+/**
+ * @brief Gets hash and number of values in range [lo, hi].
+ * 
+ * Summaries of ranges are what replicas exchange to find differences,
+ * when their trees are in different processes: ranges with equal hashes
+ * are skipped and mismatched ones are halved, as rbt_diff() does.
+ * 
+ * @param tree Pointer to tree object with subtree hashing.
+ * @param lo Low end of range.
+ * @param hi High end of range.
+ * @param hash Pointer to store hash to.
+ * @param count Pointer to store number of values to, may be NULL.
+ * @return int 0 on success, -1 on error.
+ */
+int rbt_range_hash(struct RBTree *tree, value_t lo, value_t hi,
+                   uint64_t *hash, size_t *count);
+
+/**
+ * @brief Reports values, that are present in only one of two trees.
+ * 
+ * Descends only into value ranges with mismatched hashes, so it takes
+ * O(d log n log V) for d differences, where V is span of values.
+ * Both trees must have subtree hashing enabled.
+ * 
+ * @param ltree Pointer to the first tree object.
+ * @param rtree Pointer to the second tree object.
+ * @param callback Function receiving value, side (0 if value is only
+ * in ltree, 1 if only in rtree) and data.
+ * @param data Pointer to pass to callback function.
+ * @return int 0 on success, -1 on error.
+ */
+int rbt_diff(struct RBTree *ltree, struct RBTree *rtree,
+             void (*callback)(value_t, int, void*), void *data);
+
+/**
+ * @brief Monoid, that summarizes values of tree.
+ * 
+ * Aggregate of values v1 < v2 < ... < vn is
+ * combine(...combine(lift(v1), lift(v2))..., lift(vn)), so combine
+ * must be associative and identity must be its neutral element.
+ * Commutativity isn't required.
+ */
+struct rbt_monoid {
+        int64_t (*lift)(value_t val);                 ///< Aggregate of single value.
+        int64_t (*combine)(int64_t lhs, int64_t rhs); ///< Aggregate of adjacent ranges.
+        int64_t identity;                             ///< Aggregate of empty range.
+};
+
+extern const struct rbt_monoid rbt_monoid_sum;   ///< Sum of values.
+extern const struct rbt_monoid rbt_monoid_count; ///< Number of values.
+extern const struct rbt_monoid rbt_monoid_min;   ///< Minimum value, INT64_MAX if none.
+extern const struct rbt_monoid rbt_monoid_max;   ///< Maximum value, INT64_MIN if none.
+
+/**
+ * @brief Sets monoid, that is aggregated over subtrees.
+ * 
+ * Every node keeps aggregate of its subtree, updated on insertions,
+ * removals and rotations, so aggregate of any range takes O(log n).
+ * Monoid can be set only for empty tree, that is neither multiset,
+ * intrusive, interval tree nor tree with subtree hashing. Trees
+ * can be joined only if they have the same monoid.
+ * 
+ * @param tree Pointer to tree object.
+ * @param monoid Monoid, that must outlive the tree, or NULL to disable.
+ * @return int 0 on success, -1 on error.
+ */
+int rbt_set_aggregate(struct RBTree *tree, const struct rbt_monoid *monoid);
+
+/**
+ * @brief Aggregates values in range [lo, hi].
+ * 
+ * Merges write buffer of tree first, so tree isn't const.
+ * 
+ * @param tree Pointer to tree object with monoid.
+ * @param lo Low end of range.
+ * @param hi High end of range.
+ * @param result Pointer to store aggregate to, identity for empty range.
+ * @return int 0 on success, -1 on error.
+ */
+int rbt_range_aggregate(struct RBTree *tree, value_t lo, value_t hi,
+                        int64_t *result);
+
+/**
+ * @brief Switches membership filter.
+ * 
+ * Filter is a blocked Bloom filter, that lets rbt_contains() answer
+ * most misses by reading one cache line instead of walking the tree.
+ * It is updated on insertion and rbt_join() and rebuilt in O(n)
+ * by the mutating function, that makes it stale by removals or growth,
+ * so lookups never write to the tree. Takes about 3 bytes per value.
+ * Clones and parts made by rbt_split() don't inherit the filter.
+ * 
+ * @param tree Pointer to tree object.
+ * @param enable Nonzero to build filter, 0 to drop it.
+ * @return int 0 on success, -1 on error.
+ */
+int rbt_set_filter(struct RBTree *tree, int enable);
+
+/**
+ * @brief Switches small set mode.
+ * 
+ * In this mode set of at most limit values is kept as sorted array
+ * instead of nodes, so it takes one allocation and is searched by
+ * binary search. rbt_insert(), rbt_remove(), rbt_contains(), rbt_count(),
+ * rbt_foreach(), rbt_get_size(), rbt_min(), rbt_max(), rbt_pop_min(),
+ * rbt_pop_max(), rbt_to_array(), rbt_clone(), rbt_insert_hint() and
+ * cursors work on array directly. Cursor of small set is a position
+ * in array, so it is invalidated by any change of the set, and it has
+ * no node. Insertion past the limit and any other function convert set
+ * into tree, which turns back into array, when rbt_remove(),
+ * rbt_pop_min() or rbt_pop_max() shrinks it to half of the limit.
+ * Only plain sets without write buffer can be small, and filter keeps
+ * tree from turning back into array.
+ * 
+ * @param tree Pointer to tree object.
+ * @param limit Maximum size of array, 0 to disable the mode.
+ * @return int 0 on success, -1 on error.
+ * @warning Conversions invalidate cursors and nodes of the tree.
+ */
+int rbt_set_small(struct RBTree *tree, size_t limit);
+
+/**
+ * @brief Switches relaxed balance mode.
+ * 
+ * In this mode insertion only links red node and queues it, if its
+ * parent is red, instead of recoloring and rotating up the tree.
+ * Black heights stay valid, so searches, iteration and other
+ * read-only functions work on tree with pending violations. Insertion
+ * under violating parent is rebalanced at once, so there are at most
+ * two red nodes in a row and height stays within 3/2 of the bound
+ * of balanced tree. Violations are fixed by rbt_rebalance(). Removal and
+ * rbt_split(), rbt_join(), rbt_remove_range(), rbt_export() fix all
+ * of them first. rbt_clone() leaves source as is and queues its
+ * violations in the copy. Disabling the mode fixes all pending
+ * violations.
+ * 
+ * @param tree Pointer to tree object.
+ * @param enable Nonzero to defer rebalancing, 0 to rebalance on insertion.
+ * @return int 0 on success, -1 on error.
+ */
+int rbt_set_relaxed(struct RBTree *tree, int enable);
+
+/**
+ * @brief Fixes balance violations left by insertions in relaxed mode.
+ * 
+ * Performs at most budget fix-ups, each of them takes amortized
+ * constant time, so work can be spread over idle periods.
+ * 
+ * @param tree Pointer to tree object.
+ * @param budget Maximum number of queued violations to fix.
+ * @return int 1 if tree is balanced, 0 if violations remain, -1 on error.
+ */
+int rbt_rebalance(struct RBTree *tree, size_t budget);
+
+/**
+ * @brief Switches finger search mode.
+ * 
+ * In finger mode tree remembers the last accessed node. rbt_contains(),
+ * rbt_insert() and rbt_remove() climb from it to the lowest subtree, that
+ * can hold requested value, and descend from there. Search costs O(log d),
+ * where d is the distance in ranks between current and previous values,
+ * so runs of nearby values get cheaper, while random access gets
+ * slightly slower. Mode is off by default.
+ * 
+ * @param tree Pointer to tree object.
+ * @param enable Nonzero to enable finger search, 0 to disable.
+ * @return int 0 on success, -1 on error.
+ * @warning In finger mode rbt_contains() updates the finger, so
+ * concurrent lookups on the same tree need external synchronization.
+ */
+int rbt_set_finger(struct RBTree *tree, int enable);
+
+/**
+ * @brief Sets cursor to the smallest value not less than given one.
+ * 
+ * @param tree Pointer to tree object.
+ * @param val Value to search for.
+ * @param cursor Cursor to set.
+ * @return int 1 if such value exists, 0 if cursor is past the end,
+ * -1 on error.
+ */
+int rbt_cursor_seek(struct RBTree *tree, value_t val, struct RBCursor *cursor);
+
+/**
+ * @brief Reads value under cursor.
+ * 
+ * @param cursor Pointer to cursor.
+ * @param val Pointer to store value to.
+ * @return int 1 on success, 0 if cursor is past the end, -1 on error.
+ */
+int rbt_cursor_get(const struct RBCursor *cursor, value_t *val);
+
+/**
+ * @brief Moves cursor to the next value in ascending order.
+ * 
+ * @param cursor Pointer to cursor.
+ * @return int 1 if cursor points to value, 0 if it went past the end,
+ * -1 on error.
+ */
+int rbt_cursor_next(struct RBCursor *cursor);
+
+/**
+ * @brief Copies values from cursor on into buffer and moves cursor past them.
+ * 
+ * Values are copied in ascending order without callbacks, so large sets
+ * can be transferred in chunks of fixed size by repeated calls.
+ * Multiset values are copied once, as by rbt_foreach().
+ * 
+ * @param cursor Pointer to cursor, that is left at the first value,
+ * that didn't fit, or past the end.
+ * @param out Buffer for values.
+ * @param cap Capacity of buffer.
+ * @return size_t Number of copied values, 0 at the end of tree or on error.
+ */
+size_t rbt_export_chunk(struct RBCursor *cursor, value_t *out, size_t cap);
+
+/**
+ * @brief Copies the smallest values of tree into buffer.
+ * 
+ * @param tree Pointer to tree object.
+ * @param out Buffer for values.
+ * @param cap Capacity of buffer, all values fit if it is rbt_get_size().
+ * @return size_t Number of copied values, 0 on error.
+ */
+size_t rbt_to_array(struct RBTree *tree, value_t *out, size_t cap);
+
+/**
+ * @brief Moves cursor to the previous value in ascending order.
+ * 
+ * @param cursor Pointer to cursor.
+ * @return int 1 if cursor points to value, 0 if it went past the end,
+ * -1 on error.
+ */
+int rbt_cursor_prev(struct RBCursor *cursor);
+
+/**
+ * @brief Get number of occurrences of value under cursor.
+ * 
+ * @param cursor Pointer to cursor.
+ * @return size_t Count of value, 0 if cursor is past the end or on error.
+ */
+size_t rbt_cursor_count(const struct RBCursor *cursor);
+
+/**
+ * @brief Splits tree by key.
+ * 
+ * Moves values less than key into new tree left and the rest into
+ * new tree right, reusing nodes of the source tree. Takes O(log n).
+ * Source tree is destroyed on success.
+ * 
+ * @param tree Pointer to tree object.
+ * @param key Value to split by.
+ * @param left Pointer to store tree with values less than key to.
+ * @param right Pointer to store tree with values not less than key to.
+ * @return int 0 on success, -1 on error. On error source tree is intact.
+ */
+int rbt_split(struct RBTree *tree, value_t key,
+              struct RBTree **left, struct RBTree **right);
+
+/**
+ * @brief Joins two trees.
+ * 
+ * Moves all values of right into left, reusing nodes. All values of left
+ * must be less than all values of right. Takes O(log n).
+ * With membership filter on, values of right are also added
+ * to the filter of left, which takes O(m) for m values of right.
+ * Tree right is destroyed on success. Both trees must have the same
+ * allocator and modes.
+ * 
+ * @param left Pointer to tree object, that receives values.
+ * @param right Pointer to tree object with greater values.
+ * @return int 0 on success, -1 on error. On error both trees are intact.
+ */
+int rbt_join(struct RBTree *left, struct RBTree *right);
+
+/**
+ * @brief Switches write-buffered mode.
+ * 
+ * In buffered mode rbt_insert() and rbt_remove() append mutation
+ * to a buffer of given capacity. Full buffer is sorted and merged
+ * into the tree in bulk, where sorted insertions don't descend
+ * from the root. rbt_contains() and rbt_count() look through both
+ * buffer and tree, other functions merge buffer first, so results
+ * stay exact. Buffered rbt_insert() and rbt_remove() return 1 once
+ * mutation is queued, without telling whether it changes the tree.
+ * Mode isn't available for intrusive trees.
+ * 
+ * @param tree Pointer to tree object.
+ * @param capacity Number of mutations to buffer, 0 to disable buffering.
+ * @return int 0 on success, -1 on error.
+ */
+int rbt_set_buffered(struct RBTree *tree, size_t capacity);
+
+/**
+ * @brief Merges write buffer into tree.
+ * 
+ * @param tree Pointer to tree object.
+ * @return int 0 on success, -1 on error. On error mutations, that
+ * were not merged, stay in buffer.
+ */
+int rbt_flush(struct RBTree *tree);
+
+/**
+ * @brief Switches multiset mode.
+ * 
+ * In multiset mode each value has count of its occurrences. Inserting
+ * present value increments count and removing decrements it, so repeated
+ * values don't change tree structure. Value is unlinked when its count
+ * drops to zero. rbt_get_size() and iteration see each value once,
+ * counts are available through rbt_count() and rbt_cursor_count().
+ * Mode can be switched only on empty tree.
+ * 
+ * @param tree Pointer to tree object.
+ * @param enable Nonzero to enable multiset mode, 0 to disable.
+ * @return int 0 on success, -1 on error or if tree is not empty.
+ */
+int rbt_set_multiset(struct RBTree *tree, int enable);
+
+/**
+ * @brief Get number of occurrences of value.
+ * 
+ * @param tree Pointer to tree object.
+ * @param val Value to search for.
+ * @return size_t Count of value, 0 if it is not in tree or an error occured.
+ * Outside of multiset mode count is either 0 or 1.
+ */
+size_t rbt_count(const struct RBTree *tree, value_t val);
+
 /**
  * @brief Get number of values stored in a tree.
  * 
+ * Takes constant time, except for the first call on a tree
+ * produced by rbt_split(), which counts values in linear time.
+ * 
  * @param tree Pointer to tree object.
- * @return size_t number of values stored in tree.
+ * @return size_t number of values stored in tree, (size_t)-1 if write
+ * buffer can't be merged.
  */
 size_t rbt_get_size(struct RBTree *tree);
 
+/// Output formats of rbt_export().
+enum RBTFormat {
+        RBT_DOT,    ///< Graphviz dot language, suitable for small trees.
+        RBT_JSON,   ///< JSON object with array of nodes in preorder.
+        RBT_BINARY  ///< Compact binary preorder shape records.
+};
+
+/**
+ * @brief Writes tree structure to file.
+ * 
+ * Available in both debug and release builds. Tree is exported in one
+ * linear traversal through a large output buffer, so it is suitable
+ * for trees with millions of nodes.
+ * 
+ * Nodes are written in preorder. RBT_JSON produces object
+ * {"size": n, "nodes": [...]}, where each node is
+ * {"v": value, "c": "r" or "b", "d": depth, "l": left, "r": right}
+ * and links hold values of children or null.
+ * RBT_BINARY produces magic "RBT1", 64-bit number of nodes and
+ * then for each node its value_t followed by one flags byte:
+ * 0x1 - red node, 0x2 - has left child, 0x4 - has right child.
+ * Multibyte fields use host byte order.
+ * 
+ * @param tree Pointer to tree object.
+ * @param filename Name of output file.
+ * @param format Output format.
+ * @return int 0 on success, -1 on error.
+ */
+int rbt_export(struct RBTree *tree, const char *filename,
+               enum RBTFormat format);
+
 /**
  * @brief Creates tree representation in dot format.
  * 
- * Available only in debug build. Creates tree representation on dot language 
- * and writes it to file. Used to obtain visual tree graph via graphviz dot.
+ * Creates tree representation on dot language and writes it to file.
+ * Used to obtain visual tree graph via graphviz dot.
+ * Same as rbt_export() with RBT_DOT format.
  * 
  * @param tree Pointer to tree object.
  * @param filename Name of output file for dot language.
@@ -1,6 +1,9 @@
 #include "RBTree.h"
+#include "RBTopDown.h"
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <errno.h>
 #include <limits.h>
 
@@ -10,6 +13,8 @@ static unsigned long Seed = 42;
 
 int check(int cond, int test, int line);
 
+int same_values(struct RBTree *lhs, struct RBTree *rhs);
+
 unsigned long getul(char* argv);
 
 void test1(int test)
@@ -254,6 +259,1649 @@ void test13(int test)
         check(rbt_destruct(tree) == 0, test, __LINE__);
 }
 
+/* Reads subtree in rbt_export() binary format, checks ordering
+ * and returns its black height, or -1 on broken input. */
+int t14_read(FILE *file, size_t *count, value_t lo, value_t hi)
+{
+        value_t val = 0;
+        unsigned char flags = 0;
+        if (fread(&val, sizeof(val), 1, file) != 1 ||
+            fread(&flags, sizeof(flags), 1, file) != 1) {
+                return -1;
+        }
+        (*count)++;
+        if (val < lo || val > hi) {
+                return -1;
+        }
+        int l_bh = 0;
+        int r_bh = 0;
+        if (flags & 0x2) {
+                l_bh = t14_read(file, count, lo, val - 1);
+        }
+        if (flags & 0x4) {
+                r_bh = t14_read(file, count, val + 1, hi);
+        }
+        if (l_bh < 0 || l_bh != r_bh) {
+                return -1;
+        }
+        return l_bh + !(flags & 0x1);
+}
+
+void test14(int test)
+{
+        struct RBTree *tree = rbt_init();
+        size_t N = 1000;
+        srand(Seed);
+        for (size_t i = 0; i < N; i++) {
+                rbt_insert(tree, rand() % (10 * N));
+        }
+        check(rbt_export(tree, "14-1.json", RBT_JSON) == 0, test, __LINE__);
+        check(rbt_export(tree, "14-1.dot", RBT_DOT) == 0, test, __LINE__);
+        check(rbt_export(tree, "14-1.bin", RBT_BINARY) == 0, test, __LINE__);
+        check(rbt_export(NULL, "14-1.bin", RBT_BINARY) == -1, test, __LINE__);
+
+        FILE *file = fopen("14-1.bin", "rb");
+        check(file != NULL, test, __LINE__);
+        char magic[4];
+        uint64_t size = 0;
+        check(fread(magic, sizeof(magic), 1, file) == 1, test, __LINE__);
+        check(memcmp(magic, "RBT1", sizeof(magic)) == 0, test, __LINE__);
+        check(fread(&size, sizeof(size), 1, file) == 1, test, __LINE__);
+        check(size == rbt_get_size(tree), test, __LINE__);
+        size_t count = 0;
+        check(t14_read(file, &count, INT_MIN, INT_MAX) > 0, test, __LINE__);
+        check(count == size, test, __LINE__);
+        check(fgetc(file) == EOF, test, __LINE__);
+        fclose(file);
+        rbt_destruct(tree);
+}
+
+void test15(int test)
+{
+        size_t N = 2000;
+        struct RBTree *tree = rbt_init();
+        for (size_t i = 0; i < N; i++) {
+                rbt_insert(tree, i);
+        }
+        int ret = 0;
+        size_t calls = 0;
+        while ((ret = rbt_destruct_incremental(tree, 100)) == 0) {
+                calls++;
+        }
+        check(ret == 1, test, __LINE__);
+        check(calls >= N / 100 && calls <= 2 * N / 100 + 1, test, __LINE__);
+        check(rbt_destruct_incremental(NULL, 1) == -1, test, __LINE__);
+
+        tree = rbt_init();
+        for (size_t i = 0; i < N; i++) {
+                rbt_insert(tree, rand());
+        }
+        check(rbt_destruct_incremental(tree, 10) == 0, test, __LINE__);
+        check(rbt_destruct_async(tree) == 0, test, __LINE__);
+        check(rbt_destruct_async(NULL) == -1, test, __LINE__);
+}
+
+void test16(int test)
+{
+        struct RBTree *tree = rbt_init();
+        struct RBCursor hint = {NULL, NULL, 0, 0};
+        size_t N = 2000;
+        for (size_t i = 0; i < N; i++) {
+                // nearly sorted: every tenth value comes late
+                value_t val = (i % 10 == 0) ? i / 2 : i;
+                int ret = rbt_insert_hint(tree, &hint, val);
+                check(ret != -1, test, __LINE__);
+                value_t cur = -1;
+                check(rbt_cursor_get(&hint, &cur) == 1, test, __LINE__);
+                check(cur == val, test, __LINE__);
+        }
+        for (size_t i = 0; i < N; i++) {
+                check(rbt_contains(tree, i) == (i % 10 != 0 || i < N / 2),
+                      test, __LINE__);
+        }
+        check(rbt_insert_hint(tree, NULL, N) == 1, test, __LINE__);
+        check(rbt_insert(tree, N + 1) == 1, test, __LINE__);
+
+        struct RBCursor cur;
+        value_t val = 0;
+        value_t prev = -1;
+        size_t count = 0;
+        check(rbt_cursor_seek(tree, 0, &cur) == 1, test, __LINE__);
+        do {
+                check(rbt_cursor_get(&cur, &val) == 1, test, __LINE__);
+                check(val > prev, test, __LINE__);
+                prev = val;
+                count++;
+        } while (rbt_cursor_next(&cur) == 1);
+        check(count == rbt_get_size(tree), test, __LINE__);
+        check(rbt_cursor_get(&cur, &val) == 0, test, __LINE__);
+
+        check(rbt_cursor_seek(tree, N + 1, &cur) == 1, test, __LINE__);
+        check(rbt_cursor_prev(&cur) == 1, test, __LINE__);
+        check(rbt_cursor_get(&cur, &val) == 1 && val == (value_t)N,
+              test, __LINE__);
+        check(rbt_cursor_seek(tree, N + 2, &cur) == 0, test, __LINE__);
+        check(rbt_cursor_seek(tree, N / 2, &cur) == 1, test, __LINE__);
+        check(rbt_cursor_get(&cur, &val) == 1 && val == (value_t)N / 2 + 1,
+              test, __LINE__);
+
+        // stale hint from other tree is ignored
+        struct RBTree *other = rbt_init();
+        check(rbt_insert_hint(other, &cur, 5) == 1, test, __LINE__);
+        check(cur.tree == other, test, __LINE__);
+        check(rbt_insert_hint(NULL, &cur, 5) == -1, test, __LINE__);
+        rbt_destruct(other);
+        rbt_destruct(tree);
+}
+
+void test17(int test)
+{
+        struct RBTree *tree = rbt_init();
+        struct RBTree *ref = rbt_init();
+        check(rbt_set_finger(tree, 1) == 0, test, __LINE__);
+        check(rbt_set_finger(NULL, 1) == -1, test, __LINE__);
+        size_t N = 5000;
+        value_t val = 0;
+        srand(Seed);
+        for (size_t i = 0; i < N; i++) {
+                // random walk, so most accesses are close to the previous
+                val += rand() % 21 - 10;
+                switch (rand() % 3) {
+                case 0:
+                        check(rbt_insert(tree, val) == rbt_insert(ref, val),
+                              test, __LINE__);
+                        break;
+                case 1:
+                        check(rbt_remove(tree, val) == rbt_remove(ref, val),
+                              test, __LINE__);
+                        break;
+                default:
+                        check(rbt_contains(tree, val) == rbt_contains(ref, val),
+                              test, __LINE__);
+                        break;
+                }
+        }
+        check(rbt_get_size(tree) == rbt_get_size(ref), test, __LINE__);
+        check(rbt_set_finger(tree, 0) == 0, test, __LINE__);
+        for (value_t v = -1000; v <= 1000; v++) {
+                check(rbt_contains(tree, v) == rbt_contains(ref, v),
+                      test, __LINE__);
+        }
+        rbt_destruct(ref);
+        rbt_destruct(tree);
+}
+
+void test18(int test)
+{
+        struct RBTree *tree = rbt_init();
+        value_t val = 0;
+        check(rbt_min(tree, &val) == 0, test, __LINE__);
+        check(rbt_pop_max(tree, &val) == 0, test, __LINE__);
+        check(rbt_min(NULL, &val) == -1, test, __LINE__);
+        check(rbt_pop_min(NULL, &val) == -1, test, __LINE__);
+
+        size_t N = 1000;
+        srand(Seed);
+        for (size_t i = 0; i < N; i++) {
+                rbt_insert(tree, rand() % N);
+        }
+        // removing inner values moves extremes through value swap
+        for (size_t i = 0; i < N; i += 3) {
+                rbt_remove(tree, i);
+        }
+        value_t prev = -1;
+        size_t size = rbt_get_size(tree);
+        for (size_t i = 0; i < size / 2; i++) {
+                value_t min = 0;
+                check(rbt_min(tree, &min) == 1, test, __LINE__);
+                check(rbt_pop_min(tree, &val) == 1, test, __LINE__);
+                check(val == min && val > prev, test, __LINE__);
+                check(!rbt_contains(tree, val), test, __LINE__);
+                prev = val;
+        }
+        prev = N;
+        while (rbt_get_size(tree) > 0) {
+                value_t max = 0;
+                check(rbt_max(tree, &max) == 1, test, __LINE__);
+                check(rbt_pop_max(tree, &val) == 1, test, __LINE__);
+                check(val == max && val < prev, test, __LINE__);
+                prev = val;
+        }
+        check(rbt_pop_min(tree, NULL) == 0, test, __LINE__);
+        check(rbt_max(tree, &val) == 0, test, __LINE__);
+        rbt_destruct(tree);
+}
+
+void test19(int test)
+{
+        struct RBTree *tree = rbt_init();
+        size_t N = 3000;
+        for (size_t i = 0; i < N; i++) {
+                rbt_insert(tree, 2 * i);
+        }
+        struct RBTree *left = NULL;
+        struct RBTree *right = NULL;
+        check(rbt_split(NULL, 0, &left, &right) == -1, test, __LINE__);
+        check(rbt_split(tree, 1001, &left, &right) == 0, test, __LINE__);
+        check(rbt_get_size(left) == 501, test, __LINE__);
+        check(rbt_get_size(right) == N - 501, test, __LINE__);
+        value_t val = 0;
+        check(rbt_max(left, &val) == 1 && val == 1000, test, __LINE__);
+        check(rbt_min(right, &val) == 1 && val == 1002, test, __LINE__);
+        check(rbt_contains(left, 1000) && !rbt_contains(left, 1002),
+              test, __LINE__);
+        check(rbt_contains(right, 1002) && !rbt_contains(right, 1000),
+              test, __LINE__);
+        check(rbt_join(right, left) == -1, test, __LINE__);
+        check(rbt_join(left, left) == -1, test, __LINE__);
+
+        // splitting further into small and empty parts
+        struct RBTree *parts[4];
+        check(rbt_split(left, 0, &parts[0], &parts[1]) == 0, test, __LINE__);
+        check(rbt_get_size(parts[0]) == 0, test, __LINE__);
+        check(rbt_split(right, 2 * N, &parts[2], &parts[3]) == 0,
+              test, __LINE__);
+        check(rbt_get_size(parts[3]) == 0, test, __LINE__);
+        check(rbt_insert(parts[1], 1001) == 1, test, __LINE__);
+        check(rbt_remove(parts[2], 1002) == 1, test, __LINE__);
+
+        for (int i = 1; i < 4; i++) {
+                check(rbt_join(parts[0], parts[i]) == 0, test, __LINE__);
+        }
+        tree = parts[0];
+        check(rbt_get_size(tree) == N, test, __LINE__);
+        check(rbt_contains(tree, 1001) && !rbt_contains(tree, 1002),
+              test, __LINE__);
+        check(rbt_min(tree, &val) == 1 && val == 0, test, __LINE__);
+        check(rbt_max(tree, &val) == 1 && val == 2 * ((value_t)N - 1),
+              test, __LINE__);
+
+        // random splits and joins keep the tree valid
+        srand(Seed);
+        for (int i = 0; i < 50; i++) {
+                value_t key = rand() % (2 * N);
+                check(rbt_split(tree, key, &left, &right) == 0, test, __LINE__);
+                check(rbt_join(left, right) == 0, test, __LINE__);
+                tree = left;
+                check(rbt_get_size(tree) == N, test, __LINE__);
+        }
+        struct RBCursor cur;
+        size_t count = 0;
+        check(rbt_cursor_seek(tree, 0, &cur) == 1, test, __LINE__);
+        do {
+                count++;
+        } while (rbt_cursor_next(&cur) == 1);
+        check(count == N, test, __LINE__);
+        rbt_destruct(tree);
+}
+
+void test20(int test)
+{
+        check(rbt_clone(NULL) == NULL, test, __LINE__);
+        struct RBTree *tree = rbt_init();
+        struct RBTree *copy = rbt_clone(tree);
+        check(copy != NULL && rbt_get_size(copy) == 0, test, __LINE__);
+        rbt_destruct(copy);
+
+        size_t N = 1000;
+        srand(Seed);
+        for (size_t i = 0; i < N; i++) {
+                rbt_insert(tree, rand() % (4 * N));
+        }
+        copy = rbt_clone(tree);
+        check(copy != NULL, test, __LINE__);
+        check(rbt_get_size(copy) == rbt_get_size(tree), test, __LINE__);
+        check(rbt_export(tree, "20-1.bin", RBT_BINARY) == 0, test, __LINE__);
+        check(rbt_export(copy, "20-2.bin", RBT_BINARY) == 0, test, __LINE__);
+        FILE *orig_file = fopen("20-1.bin", "rb");
+        FILE *copy_file = fopen("20-2.bin", "rb");
+        int orig_ch = 0;
+        int copy_ch = 0;
+        do {
+                orig_ch = fgetc(orig_file);
+                copy_ch = fgetc(copy_file);
+        } while (orig_ch == copy_ch && orig_ch != EOF);
+        check(orig_ch == copy_ch, test, __LINE__);
+        fclose(orig_file);
+        fclose(copy_file);
+
+        // copy is independent from the original
+        value_t min = 0;
+        value_t val = 0;
+        check(rbt_min(tree, &min) == 1, test, __LINE__);
+        check(rbt_pop_min(copy, &val) == 1 && val == min, test, __LINE__);
+        check(rbt_contains(tree, min), test, __LINE__);
+        check(rbt_insert(copy, 4 * N) == 1, test, __LINE__);
+        check(rbt_max(copy, &val) == 1 && val == 4 * (value_t)N,
+              test, __LINE__);
+        check(!rbt_contains(tree, 4 * N), test, __LINE__);
+        rbt_destruct(copy);
+#ifndef NDEBUG
+        malloc_fail_enable();
+        check(rbt_clone(tree) == NULL, test, __LINE__);
+        malloc_fail_disable();
+#endif
+        rbt_destruct(tree);
+}
+
+void test21(int test)
+{
+        struct RBTree *tree = rbt_init();
+        check(rbt_insert(tree, 1) == 1, test, __LINE__);
+        check(rbt_set_multiset(tree, 1) == -1, test, __LINE__);
+        check(rbt_count(tree, 1) == 1, test, __LINE__);
+        rbt_remove(tree, 1);
+        check(rbt_set_multiset(tree, 1) == 0, test, __LINE__);
+        check(rbt_set_multiset(NULL, 1) == -1, test, __LINE__);
+
+        size_t N = 100;
+        for (size_t k = 1; k <= 3; k++) {
+                for (size_t i = 0; i < N; i++) {
+                        check(rbt_insert(tree, i) == (k == 1), test, __LINE__);
+                }
+        }
+        struct RBCursor hint = {NULL, NULL, 0, 0};
+        check(rbt_insert_hint(tree, &hint, 0) == 0, test, __LINE__);
+        check(rbt_get_size(tree) == N, test, __LINE__);
+        check(rbt_count(tree, 0) == 4 && rbt_count(tree, 1) == 3,
+              test, __LINE__);
+        check(rbt_count(tree, N) == 0, test, __LINE__);
+
+        // removing inner values swaps counts along with values
+        for (size_t i = 1; i < N; i += 2) {
+                check(rbt_remove(tree, i) == 1, test, __LINE__);
+                check(rbt_remove(tree, i) == 1, test, __LINE__);
+                check(rbt_remove(tree, i) == 1, test, __LINE__);
+                check(rbt_remove(tree, i) == 0, test, __LINE__);
+        }
+        check(rbt_get_size(tree) == N / 2, test, __LINE__);
+        struct RBCursor cur;
+        check(rbt_cursor_seek(tree, 1, &cur) == 1, test, __LINE__);
+        do {
+                check(rbt_cursor_count(&cur) == 3, test, __LINE__);
+        } while (rbt_cursor_next(&cur) == 1);
+        check(rbt_cursor_count(&cur) == 0, test, __LINE__);
+
+        value_t val = -1;
+        check(rbt_pop_min(tree, &val) == 1 && val == 0, test, __LINE__);
+        check(rbt_count(tree, 0) == 3, test, __LINE__);
+
+        struct RBTree *copy = rbt_clone(tree);
+        check(rbt_count(copy, 2) == 3, test, __LINE__);
+        struct RBTree *left = NULL;
+        struct RBTree *right = NULL;
+        check(rbt_split(copy, N / 2, &left, &right) == 0, test, __LINE__);
+        check(rbt_insert(right, N - 2) == 0, test, __LINE__);
+        check(rbt_count(right, N - 2) == 4, test, __LINE__);
+        check(rbt_join(left, right) == 0, test, __LINE__);
+        check(rbt_count(left, 0) == 3 && rbt_count(left, N - 2) == 4,
+              test, __LINE__);
+        rbt_destruct(left);
+
+        struct RBTree *set = rbt_init();
+        check(rbt_insert(set, 2 * N) == 1, test, __LINE__);
+        check(rbt_join(tree, set) == -1, test, __LINE__);
+        rbt_destruct(set);
+        rbt_destruct(tree);
+}
+
+struct t22_item {
+        int payload;
+        struct RBNode link;
+};
+
+void test22(int test)
+{
+        struct RBTree *tree = rbt_init();
+        check(rbt_set_intrusive(tree, 1) == 0, test, __LINE__);
+        check(rbt_set_multiset(tree, 1) == -1, test, __LINE__);
+        check(rbt_insert(tree, 1) == -1, test, __LINE__);
+        check(rbt_clone(tree) == NULL, test, __LINE__);
+
+        enum {N = 500};
+        static struct t22_item items[N];
+        for (int i = 0; i < N; i++) {
+                items[i].payload = 3 * i;
+                check(rbt_link(tree, &items[i].link, (i * 7) % N) == 1,
+                      test, __LINE__);
+        }
+        struct t22_item dup;
+        check(rbt_link(tree, &dup.link, 7) == 0, test, __LINE__);
+        check(rbt_get_size(tree) == N, test, __LINE__);
+
+        struct RBNode *node = rbt_find_node(tree, 7);
+        check(node == &items[1].link, test, __LINE__);
+        check(rbt_entry(node, struct t22_item, link)->payload == 3,
+              test, __LINE__);
+        check(rbt_find_node(tree, N) == NULL, test, __LINE__);
+
+        // unlinking inner nodes keeps other nodes in place
+        for (int i = 0; i < N; i += 2) {
+                check(rbt_unlink(tree, &items[i].link) == 0, test, __LINE__);
+        }
+        check(rbt_get_size(tree) == N / 2, test, __LINE__);
+        struct RBCursor cur;
+        check(rbt_cursor_seek(tree, 0, &cur) == 1, test, __LINE__);
+        do {
+                node = rbt_cursor_node(&cur);
+                struct t22_item *item = rbt_entry(node, struct t22_item, link);
+                int index = item->payload / 3;
+                check(index % 2 == 1, test, __LINE__);
+                check(rbt_node_value(node) == (index * 7) % N, test, __LINE__);
+        } while (rbt_cursor_next(&cur) == 1);
+
+        value_t val = 0;
+        check(rbt_pop_min(tree, &val) == 1, test, __LINE__);
+        check(rbt_remove(tree, 7) == 1, test, __LINE__);
+        check(rbt_find_node(tree, 7) == NULL, test, __LINE__);
+        check(rbt_link(tree, &items[1].link, 7) == 1, test, __LINE__);
+        rbt_destruct(tree);
+
+        tree = rbt_init();
+        check(rbt_link(tree, &dup.link, 7) == -1, test, __LINE__);
+        check(rbt_unlink(tree, &dup.link) == -1, test, __LINE__);
+        rbt_destruct(tree);
+}
+
+void test23(int test)
+{
+        struct RBTree *tree = rbt_init();
+        struct RBTree *ref = rbt_init();
+        check(rbt_set_buffered(tree, 64) == 0, test, __LINE__);
+        check(rbt_set_buffered(NULL, 64) == -1, test, __LINE__);
+        check(rbt_set_intrusive(tree, 1) == -1, test, __LINE__);
+
+        size_t N = 3000;
+        srand(Seed);
+        for (size_t i = 0; i < N; i++) {
+                value_t val = rand() % 500;
+                if (rand() % 3 == 0) {
+                        check(rbt_remove(tree, val) == 1, test, __LINE__);
+                        rbt_remove(ref, val);
+                } else {
+                        check(rbt_insert(tree, val) == 1, test, __LINE__);
+                        rbt_insert(ref, val);
+                }
+                val = rand() % 500;
+                check(rbt_contains(tree, val) == rbt_contains(ref, val),
+                      test, __LINE__);
+        }
+        // insert and removal of the same value keep their order
+        check(rbt_insert(tree, 1000) == 1, test, __LINE__);
+        check(rbt_remove(tree, 1000) == 1, test, __LINE__);
+        check(rbt_remove(tree, 1001) == 1, test, __LINE__);
+        check(rbt_insert(tree, 1001) == 1, test, __LINE__);
+        check(!rbt_contains(tree, 1000) && rbt_contains(tree, 1001),
+              test, __LINE__);
+        rbt_insert(ref, 1001);
+
+        value_t val = 0;
+        value_t ref_val = 0;
+        check(rbt_max(tree, &val) == 1 && val == 1001, test, __LINE__);
+        check(rbt_get_size(tree) == rbt_get_size(ref), test, __LINE__);
+        check(rbt_flush(tree) == 0, test, __LINE__);
+        check(rbt_flush(NULL) == -1, test, __LINE__);
+        for (value_t v = 0; v < 500; v++) {
+                check(rbt_contains(tree, v) == rbt_contains(ref, v),
+                      test, __LINE__);
+        }
+        check(rbt_insert(tree, -1) == 1, test, __LINE__);
+        check(rbt_pop_min(tree, &val) == 1 && val == -1, test, __LINE__);
+        check(rbt_pop_min(tree, &val) == 1, test, __LINE__);
+        check(rbt_pop_min(ref, &ref_val) == 1 && val == ref_val, test, __LINE__);
+
+        check(rbt_set_buffered(tree, 0) == 0, test, __LINE__);
+        check(rbt_insert(tree, 2000) == 1, test, __LINE__);
+        check(rbt_insert(tree, 2000) == 0, test, __LINE__);
+        rbt_destruct(ref);
+
+        struct RBTree *bag = rbt_init();
+        check(rbt_set_multiset(bag, 1) == 0, test, __LINE__);
+        check(rbt_set_buffered(bag, 4) == 0, test, __LINE__);
+        for (int i = 0; i < 10; i++) {
+                rbt_insert(bag, 7);
+        }
+        rbt_remove(bag, 7);
+        check(rbt_count(bag, 7) == 9, test, __LINE__);
+        rbt_insert(bag, 8);
+        // copy merges queued mutations, that source keeps queued
+        struct RBTree *copy = rbt_clone(bag);
+        check(copy != NULL && rbt_count(copy, 7) == 9 && rbt_count(copy, 8) == 1,
+              test, __LINE__);
+        rbt_destruct(copy);
+        check(rbt_count(bag, 8) == 1, test, __LINE__);
+        rbt_destruct(bag);
+        rbt_destruct(tree);
+}
+
+void test24(int test)
+{
+        const char *fname = "test24.bin";
+        struct RBTree *tree = rbt_init();
+        check(rbt_record(NULL, fname) == -1, test, __LINE__);
+        check(rbt_record(tree, NULL) == 0, test, __LINE__);
+        check(rbt_record(tree, "no_such_dir/trace.bin") == -1, test, __LINE__);
+        check(rbt_record(tree, fname) == 0, test, __LINE__);
+        size_t N = 1000;
+        for (size_t i = 0; i < N; i++) {
+                rbt_insert(tree, (value_t)i);
+        }
+        rbt_contains(tree, -5);
+        rbt_remove(tree, 7);
+        check(rbt_record(tree, NULL) == 0, test, __LINE__);
+        rbt_insert(tree, 5000);
+
+        FILE *file = fopen(fname, "rb");
+        check(file != NULL, test, __LINE__);
+        unsigned char rec[5];
+        size_t count = 0;
+        int32_t val = 0;
+        while (fread(rec, 1, sizeof(rec), file) == sizeof(rec)) {
+                memcpy(&val, rec + 1, sizeof(val));
+                if (count < N) {
+                        check(rec[0] == 'i' && val == (int32_t)count, test, __LINE__);
+                }
+                count++;
+        }
+        check(count == N + 2, test, __LINE__);
+        check(rec[0] == 'r' && val == 7, test, __LINE__);
+        fclose(file);
+
+        // trace is completed on destruction
+        check(rbt_record(tree, fname) == 0, test, __LINE__);
+        rbt_contains(tree, 1);
+        rbt_destruct(tree);
+        file = fopen(fname, "rb");
+        check(file != NULL && fread(rec, 1, sizeof(rec), file) == sizeof(rec) &&
+              rec[0] == 'f', test, __LINE__);
+        fclose(file);
+
+        // replay of trace rebuilds tree changed by every kind of call
+        tree = rbt_init();
+        rbt_record(tree, fname);
+        struct RBCursor hint = {NULL, NULL, 0, 0};
+        for (value_t v = 0; v < 100; v++) {
+                rbt_insert_hint(tree, &hint, v * 2);
+        }
+        value_t popped = 0;
+        rbt_pop_min(tree, &popped);
+        rbt_pop_max(tree, &popped);
+        rbt_remove_range(tree, 50, 80, NULL);
+        struct RBTree *high = rbt_init();
+        rbt_insert(high, 1000);
+        rbt_insert(high, 1001);
+        rbt_join(tree, high);
+        rbt_record(tree, NULL);
+        struct RBTree *replayed = rbt_init();
+        file = fopen(fname, "rb");
+        while (file != NULL && fread(rec, 1, sizeof(rec), file) == sizeof(rec)) {
+                memcpy(&val, rec + 1, sizeof(val));
+                if (rec[0] == 'i') {
+                        rbt_insert(replayed, val);
+                } else if (rec[0] == 'r') {
+                        rbt_remove(replayed, val);
+                }
+        }
+        check(file != NULL && same_values(tree, replayed), test, __LINE__);
+        fclose(file);
+        rbt_destruct(replayed);
+        rbt_destruct(tree);
+        remove(fname);
+}
+
+struct Arena {
+        char *data;
+        size_t used;
+        size_t cap;
+        size_t frees;
+};
+
+static void *arena_alloc(void *ctx, size_t size)
+{
+        struct Arena *arena = ctx;
+        size = (size + 15) & ~(size_t)15;
+        if (arena->cap - arena->used < size) {
+                return NULL;
+        }
+        void *ptr = arena->data + arena->used;
+        arena->used += size;
+        return ptr;
+}
+
+static void arena_free(void *ctx, void *ptr)
+{
+        struct Arena *arena = ctx;
+        check(ptr != NULL, 25, __LINE__);
+        arena->frees++;
+}
+
+void test25(int test)
+{
+        struct Arena arena = {malloc(1 << 16), 0, 1 << 16, 0};
+        struct rbt_allocator alloc = {arena_alloc, arena_free, &arena};
+        struct rbt_allocator bad = {NULL, arena_free, &arena};
+        check(rbt_init_with_allocator(&bad) == NULL, test, __LINE__);
+
+        struct RBTree *tree = rbt_init_with_allocator(&alloc);
+        check(tree != NULL, test, __LINE__);
+        size_t N = 100;
+        for (size_t i = 0; i < N; i++) {
+                check(rbt_insert(tree, (value_t)i) == 1, test, __LINE__);
+        }
+        check(arena.used > N * 16, test, __LINE__);
+        struct RBTree *left = NULL;
+        struct RBTree *right = NULL;
+        check(rbt_split(tree, N / 2, &left, &right) == 0, test, __LINE__);
+        check(rbt_join(left, right) == 0, test, __LINE__);
+        check(rbt_remove(left, 0) == 1, test, __LINE__);
+        check(arena.frees == 3, test, __LINE__);
+
+        // nodes of different allocators are not mixed
+        struct RBTree *other = rbt_init();
+        rbt_insert(other, (value_t)N * 2);
+        check(rbt_join(left, other) == -1, test, __LINE__);
+        rbt_destruct(other);
+
+        // arena exhaustion is reported as allocation failure
+        size_t rest = arena.cap - arena.used;
+        check(arena_alloc(&arena, rest) != NULL, test, __LINE__);
+        check(rbt_insert(left, (value_t)N) == -1, test, __LINE__);
+        check(rbt_get_size(left) == N - 1, test, __LINE__);
+        rbt_destruct(left);
+        check(arena.frees == 3 + N - 1 + 1, test, __LINE__);
+        free(arena.data);
+
+        int fail = 0;
+        struct rbt_allocator faulty = rbt_fault_allocator(&fail);
+        tree = rbt_init_with_allocator(&faulty);
+        check(rbt_insert(tree, 1) == 1, test, __LINE__);
+        fail = 1;
+        check(rbt_insert(tree, 2) == -1, test, __LINE__);
+        check(rbt_clone(tree) == NULL, test, __LINE__);
+        fail = 0;
+        struct RBTree *copy = rbt_clone(tree);
+        check(copy != NULL && rbt_contains(copy, 1), test, __LINE__);
+        rbt_destruct(copy);
+        rbt_destruct(tree);
+}
+
+static void collect(value_t val, struct RBTree *tree, void *data)
+{
+        (void)tree;
+        value_t **pos = data;
+        *(*pos)++ = val;
+}
+
+void test26(int test)
+{
+        struct RBTree *tree = rbt_init();
+        struct RBTree *ref = rbt_init();
+        size_t N = 1000;
+        srand(Seed);
+        rbt_insert(tree, INT32_MIN);
+        rbt_insert(tree, INT32_MAX);
+        for (size_t i = 0; i < N; i++) {
+                value_t val = rand() % (int)(N * 8) - (int)N;
+                rbt_insert(tree, val);
+        }
+        // a run of close values and a long jump between blocks
+        for (value_t val = 100000; val < 100300; val++) {
+                rbt_insert(tree, val);
+        }
+        rbt_insert(tree, 1 << 30);
+        size_t size = rbt_get_size(tree);
+        value_t *vals = malloc(size * sizeof(*vals));
+        value_t *pos = vals;
+        rbt_foreach(tree, collect, &pos);
+        for (size_t i = 0; i < size; i++) {
+                rbt_insert(ref, vals[i]);
+        }
+
+        check(rbt_compress(tree) == 0, test, __LINE__);
+        check(rbt_compress(tree) == 0, test, __LINE__);
+        check(rbt_get_size(tree) == size, test, __LINE__);
+        check(rbt_insert(tree, 5) == -1, test, __LINE__);
+        check(rbt_remove(tree, vals[0]) == -1, test, __LINE__);
+        check(rbt_export(tree, "test26.json", RBT_JSON) == -1, test, __LINE__);
+        for (value_t val = -(value_t)N - 10; val < (value_t)N * 8; val++) {
+                check(rbt_contains(tree, val) == rbt_contains(ref, val),
+                      test, __LINE__);
+                check(rbt_count(tree, val) == rbt_count(ref, val), test, __LINE__);
+        }
+        check(rbt_contains(tree, INT32_MIN) && rbt_contains(tree, INT32_MAX) &&
+              rbt_contains(tree, 100150) && !rbt_contains(tree, 100300),
+              test, __LINE__);
+        value_t val = 0;
+        check(rbt_min(tree, &val) == 1 && val == INT32_MIN, test, __LINE__);
+        check(rbt_max(tree, &val) == 1 && val == INT32_MAX, test, __LINE__);
+
+        value_t *check_pos = malloc(size * sizeof(*vals));
+        pos = check_pos;
+        check(rbt_foreach(tree, collect, &pos) == 0, test, __LINE__);
+        check(memcmp(vals, check_pos, size * sizeof(*vals)) == 0, test, __LINE__);
+
+        // walking forward and backward across blocks
+        struct RBCursor cursor;
+        check(rbt_cursor_seek(tree, INT32_MIN, &cursor) == 1, test, __LINE__);
+        size_t count = 0;
+        do {
+                check(rbt_cursor_get(&cursor, &val) == 1 && val == vals[count],
+                      test, __LINE__);
+                count++;
+        } while (rbt_cursor_next(&cursor) == 1);
+        check(count == size, test, __LINE__);
+        check(rbt_cursor_seek(tree, INT32_MAX, &cursor) == 1, test, __LINE__);
+        check(rbt_cursor_node(&cursor) == NULL, test, __LINE__);
+        while (rbt_cursor_prev(&cursor) == 1) {
+                count--;
+                rbt_cursor_get(&cursor, &val);
+                check(val == vals[count - 1], test, __LINE__);
+        }
+        check(count == 1, test, __LINE__);
+        check(rbt_cursor_seek(tree, 100000 - 1, &cursor) == 1 &&
+              rbt_cursor_get(&cursor, &val) == 1 && val == 100000, test, __LINE__);
+
+        check(rbt_decompress(tree) == 0, test, __LINE__);
+        check(rbt_get_size(tree) == size, test, __LINE__);
+        pos = check_pos;
+        rbt_foreach(tree, collect, &pos);
+        check(memcmp(vals, check_pos, size * sizeof(*vals)) == 0, test, __LINE__);
+        check(rbt_insert(tree, 100300) == 1, test, __LINE__);
+
+        struct RBTree *empty = rbt_init();
+        check(rbt_compress(empty) == 0, test, __LINE__);
+        check(rbt_get_size(empty) == 0 && !rbt_contains(empty, 0), test, __LINE__);
+        check(rbt_min(empty, &val) == 0, test, __LINE__);
+        check(rbt_cursor_seek(empty, 0, &cursor) == 0, test, __LINE__);
+        check(rbt_decompress(empty) == 0 && rbt_insert(empty, 1) == 1, test, __LINE__);
+        rbt_destruct(empty);
+
+        struct RBTree *bag = rbt_init();
+        rbt_set_multiset(bag, 1);
+        check(rbt_compress(bag) == -1, test, __LINE__);
+        rbt_destruct(bag);
+        check(rbt_compress(ref) == 0, test, __LINE__);
+        free(vals);
+        free(check_pos);
+        rbt_destruct(ref);
+        rbt_destruct(tree);
+}
+
+void test27(int test)
+{
+        struct RBTree *tree = rbt_init();
+        struct RBTree *ref = rbt_init();
+        size_t N = 2000;
+        srand(Seed);
+        for (size_t i = 0; i < N / 2; i++) {
+                value_t val = rand() % (int)(N * 4);
+                rbt_insert(tree, val);
+                rbt_insert(ref, val);
+        }
+        check(rbt_set_filter(NULL, 1) == -1, test, __LINE__);
+        check(rbt_set_filter(tree, 1) == 0, test, __LINE__);
+        check(rbt_set_filter(tree, 1) == 0, test, __LINE__);
+        // growth over filter capacity and removals trigger rebuilds
+        for (size_t i = 0; i < N * 2; i++) {
+                value_t val = rand() % (int)(N * 4);
+                if (rand() % 3 == 0) {
+                        check(rbt_remove(tree, val) == rbt_remove(ref, val),
+                              test, __LINE__);
+                } else {
+                        check(rbt_insert(tree, val) == rbt_insert(ref, val),
+                              test, __LINE__);
+                }
+                val = rand() % (int)(N * 4);
+                check(rbt_contains(tree, val) == rbt_contains(ref, val),
+                      test, __LINE__);
+        }
+        value_t val = 0;
+        while (rbt_pop_min(tree, &val) == 1 && val < (value_t)N) {
+                check(!rbt_contains(tree, val), test, __LINE__);
+        }
+        check(rbt_contains(tree, val) == 0 && rbt_insert(tree, val) == 1 &&
+              rbt_contains(tree, val), test, __LINE__);
+
+        // values moved in by join are found
+        struct RBTree *high = rbt_init();
+        for (value_t v = (value_t)N * 10; v < (value_t)N * 11; v++) {
+                rbt_insert(high, v);
+        }
+        check(rbt_join(tree, high) == 0, test, __LINE__);
+        check(rbt_contains(tree, (value_t)N * 10) &&
+              rbt_contains(tree, (value_t)N * 11 - 1), test, __LINE__);
+        // cut values are gone, whether freed or handed over
+        struct RBTree *cut = NULL;
+        check(rbt_remove_range(tree, (value_t)N * 10 + 1,
+                               (value_t)N * 10 + N / 2, &cut) == 0,
+              test, __LINE__);
+        check(rbt_remove_range(tree, (value_t)N * 10 + N / 2 + 1,
+                               (value_t)N * 11 - 1, NULL) == 0,
+              test, __LINE__);
+        for (value_t v = (value_t)N * 10 + 1; v < (value_t)N * 11; v++) {
+                check(!rbt_contains(tree, v), test, __LINE__);
+        }
+        check(rbt_contains(tree, (value_t)N * 10), test, __LINE__);
+        rbt_destruct(cut);
+
+        check(rbt_compress(tree) == 0, test, __LINE__);
+        check(rbt_contains(tree, (value_t)N * 10) && !rbt_contains(tree, -1),
+              test, __LINE__);
+        check(rbt_decompress(tree) == 0, test, __LINE__);
+        check(rbt_set_filter(tree, 0) == 0, test, __LINE__);
+        check(rbt_contains(tree, (value_t)N * 10), test, __LINE__);
+        rbt_destruct(ref);
+        rbt_destruct(tree);
+}
+
+void test28(int test)
+{
+        struct RBTDTree *tree = rbtd_init();
+        struct RBTree *ref = rbt_init();
+        check(rbtd_insert(NULL, 1) == -1 && rbtd_remove(NULL, 1) == -1 &&
+              !rbtd_contains(NULL, 1) && rbtd_get_size(NULL) == 0 &&
+              rbtd_destruct(NULL) == -1, test, __LINE__);
+        check(rbtd_remove(tree, 1) == 0, test, __LINE__);
+        size_t N = 4000;
+        srand(Seed);
+        for (size_t i = 0; i < N; i++) {
+                value_t val = rand() % 600;
+                if (rand() % 3 == 0) {
+                        check(rbtd_remove(tree, val) == rbt_remove(ref, val),
+                              test, __LINE__);
+                } else {
+                        check(rbtd_insert(tree, val) == rbt_insert(ref, val),
+                              test, __LINE__);
+                }
+                val = rand() % 600;
+                check(rbtd_contains(tree, val) == rbt_contains(ref, val),
+                      test, __LINE__);
+        }
+        check(rbtd_get_size(tree) == rbt_get_size(ref), test, __LINE__);
+
+        struct RBTDCursor cursor;
+        struct RBCursor ref_cursor;
+        check(rbtd_cursor_seek(tree, 300, &cursor) ==
+              rbt_cursor_seek(ref, 300, &ref_cursor), test, __LINE__);
+        value_t val = 0;
+        value_t ref_val = 0;
+        while (rbtd_cursor_get(&cursor, &val) == 1) {
+                check(rbt_cursor_get(&ref_cursor, &ref_val) == 1 && val == ref_val,
+                      test, __LINE__);
+                rbtd_cursor_next(&cursor);
+                rbt_cursor_next(&ref_cursor);
+        }
+        check(rbt_cursor_get(&ref_cursor, &ref_val) == 0, test, __LINE__);
+        check(rbtd_cursor_next(&cursor) == 0, test, __LINE__);
+        check(rbtd_cursor_seek(tree, 1000, &cursor) == 0, test, __LINE__);
+
+        // sorted removal of everything
+        for (value_t v = 0; v < 600; v++) {
+                check(rbtd_remove(tree, v) == rbt_remove(ref, v), test, __LINE__);
+        }
+        check(rbtd_get_size(tree) == 0, test, __LINE__);
+        for (value_t v = 0; v < 100; v++) {
+                rbtd_insert(tree, v);
+        }
+        rbt_destruct(ref);
+        check(rbtd_destruct(tree) == 0, test, __LINE__);
+}
+
+#define SPAN29 500
+
+struct Overlaps {
+        value_t lo[SPAN29];
+        value_t hi[SPAN29];
+        size_t count;
+};
+
+static void gather(value_t lo, value_t hi, void *data)
+{
+        struct Overlaps *res = data;
+        res->lo[res->count] = lo;
+        res->hi[res->count] = hi;
+        res->count++;
+}
+
+/* Compares overlap query on tree with scan of reference array,
+ * where ends[lo] is high end of interval [lo, ends[lo]] or -1. */
+static int check_overlaps(const struct RBTree *tree, const value_t *ends,
+                          value_t lo, value_t hi)
+{
+        struct Overlaps res;
+        res.count = 0;
+        if (rbt_overlap_foreach(tree, lo, hi, gather, &res) != 0) {
+                return 0;
+        }
+        size_t count = 0;
+        for (value_t i = 0; i < SPAN29; i++) {
+                if (ends[i] < 0 || i > hi || ends[i] < lo) {
+                        continue;
+                }
+                if (count >= res.count || res.lo[count] != i || res.hi[count] != ends[i]) {
+                        return 0;
+                }
+                count++;
+        }
+        return count == res.count;
+}
+
+void test29(int test)
+{
+        struct RBTree *tree = rbt_init();
+        value_t ends[SPAN29];
+        for (size_t i = 0; i < SPAN29; i++) {
+                ends[i] = -1;
+        }
+        check(rbt_insert_interval(tree, 1, 2) == -1, test, __LINE__);
+        check(rbt_overlap_foreach(tree, 0, 1, gather, NULL) == -1, test, __LINE__);
+        check(rbt_set_interval(tree, 1) == 0, test, __LINE__);
+        check(rbt_insert(tree, 1) == -1, test, __LINE__);
+        check(rbt_insert_interval(tree, 2, 1) == -1, test, __LINE__);
+        check(rbt_set_multiset(tree, 1) == -1, test, __LINE__);
+        check(rbt_compress(tree) == -1, test, __LINE__);
+
+        srand(Seed);
+        for (size_t i = 0; i < 3000; i++) {
+                value_t lo = rand() % SPAN29;
+                if (rand() % 3 == 0) {
+                        check(rbt_remove(tree, lo) == (ends[lo] >= 0), test, __LINE__);
+                        ends[lo] = -1;
+                } else {
+                        value_t hi = lo + rand() % (rand() % 4 == 0 ? 100 : 10);
+                        int inserted = rbt_insert_interval(tree, lo, hi);
+                        check(inserted == (ends[lo] < 0), test, __LINE__);
+                        if (inserted == 1) {
+                                ends[lo] = hi;
+                        }
+                }
+                if (i % 10 == 0) {
+                        value_t qlo = rand() % (SPAN29 + 100) - 50;
+                        value_t qhi = qlo + rand() % 50;
+                        check(check_overlaps(tree, ends, qlo, qhi), test, __LINE__);
+                }
+        }
+        value_t val = 0;
+        check(rbt_pop_min(tree, &val) == 1, test, __LINE__);
+        ends[val] = -1;
+        check(check_overlaps(tree, ends, 0, SPAN29 * 2), test, __LINE__);
+
+        struct RBTree *copy = rbt_clone(tree);
+        check(copy != NULL && check_overlaps(copy, ends, 0, SPAN29 * 2), test, __LINE__);
+        rbt_destruct(copy);
+
+        struct RBTree *left = NULL;
+        struct RBTree *right = NULL;
+        check(rbt_split(tree, SPAN29 / 2, &left, &right) == 0, test, __LINE__);
+        value_t low_ends[SPAN29];
+        value_t high_ends[SPAN29];
+        for (value_t i = 0; i < SPAN29; i++) {
+                low_ends[i] = i < SPAN29 / 2 ? ends[i] : -1;
+                high_ends[i] = i < SPAN29 / 2 ? -1 : ends[i];
+        }
+        check(check_overlaps(left, low_ends, 0, SPAN29 * 2), test, __LINE__);
+        check(check_overlaps(left, low_ends, SPAN29 / 2, SPAN29 / 2 + 20), test, __LINE__);
+        check(check_overlaps(right, high_ends, 0, SPAN29 / 2 + 20), test, __LINE__);
+        check(rbt_join(left, right) == 0, test, __LINE__);
+        for (value_t lo = -10; lo < SPAN29 + 100; lo += 7) {
+                check(check_overlaps(left, ends, lo, lo + 3), test, __LINE__);
+        }
+        rbt_destruct(left);
+}
+
+void test30(int test)
+{
+        struct RBTree *tree = rbt_init();
+        char present[1000] = {0};
+        srand(Seed);
+        for (size_t i = 0; i < 700; i++) {
+                value_t val = rand() % 1000;
+                rbt_insert(tree, val);
+                present[val] = 1;
+        }
+        struct RBTree *cut = NULL;
+        check(rbt_remove_range(NULL, 0, 1, NULL) == -1, test, __LINE__);
+        check(rbt_remove_range(tree, 5, 4, &cut) == 0, test, __LINE__);
+        check(cut != NULL && rbt_get_size(cut) == 0, test, __LINE__);
+        rbt_destruct(cut);
+
+        for (int round = 0; round < 20; round++) {
+                value_t lo = rand() % 1100 - 50;
+                value_t hi = lo + rand() % 120;
+                size_t size = rbt_get_size(tree);
+                size_t in_range = 0;
+                for (value_t v = lo; v <= hi; v++) {
+                        if (v >= 0 && v < 1000 && present[v]) {
+                                in_range++;
+                                present[v] = 0;
+                        }
+                }
+                if (round % 2 == 0) {
+                        check(rbt_remove_range(tree, lo, hi, NULL) == 0, test, __LINE__);
+                } else {
+                        check(rbt_remove_range(tree, lo, hi, &cut) == 0, test, __LINE__);
+                        check(rbt_get_size(cut) == in_range, test, __LINE__);
+                        value_t val = 0;
+                        check(in_range == 0 || (rbt_min(cut, &val) == 1 && val >= lo),
+                              test, __LINE__);
+                        check(in_range == 0 || (rbt_max(cut, &val) == 1 && val <= hi),
+                              test, __LINE__);
+                        rbt_destruct_async(cut);
+                }
+                check(rbt_get_size(tree) == size - in_range, test, __LINE__);
+                for (value_t v = lo - 2; v <= hi + 2; v++) {
+                        check(rbt_contains(tree, v) == (v >= 0 && v < 1000 && present[v]),
+                              test, __LINE__);
+                }
+        }
+        // the whole tree and the maximal value
+        check(rbt_insert(tree, INT32_MAX) == 1, test, __LINE__);
+        check(rbt_remove_range(tree, 500, INT32_MAX, NULL) == 0, test, __LINE__);
+        value_t val = 0;
+        check(rbt_max(tree, &val) == 0 || val < 500, test, __LINE__);
+        check(rbt_remove_range(tree, INT32_MIN, INT32_MAX, NULL) == 0, test, __LINE__);
+        check(rbt_get_size(tree) == 0 && rbt_min(tree, &val) == 0, test, __LINE__);
+        check(rbt_insert(tree, 1) == 1, test, __LINE__);
+        rbt_destruct(tree);
+
+        struct RBTree *spans = rbt_init();
+        rbt_set_interval(spans, 1);
+        value_t ends[SPAN29];
+        for (value_t i = 0; i < SPAN29; i++) {
+                ends[i] = i % 3 == 0 ? i + i % 40 : -1;
+                if (ends[i] >= 0) {
+                        rbt_insert_interval(spans, i, ends[i]);
+                }
+        }
+        check(rbt_remove_range(spans, 100, 300, NULL) == 0, test, __LINE__);
+        for (value_t i = 100; i <= 300; i++) {
+                ends[i] = -1;
+        }
+        check(check_overlaps(spans, ends, 90, 310), test, __LINE__);
+        rbt_destruct(spans);
+
+        struct RBTree *nodes = rbt_init();
+        rbt_set_intrusive(nodes, 1);
+        check(rbt_remove_range(nodes, 0, 1, NULL) == -1, test, __LINE__);
+        rbt_destruct(nodes);
+}
+
+#define SPAN31 2000
+
+struct Diffs {
+        char side[2][SPAN31];
+        size_t count;
+};
+
+void note_diff(value_t val, int side, void *data)
+{
+        struct Diffs *diffs = data;
+        if (val >= 0 && val < SPAN31) {
+                diffs->side[side][val]++;
+        }
+        diffs->count++;
+}
+
+void test31(int test)
+{
+        struct RBTree *ltree = rbt_init();
+        struct RBTree *rtree = rbt_init();
+        check(rbt_set_merkle(ltree, 1) == 0, test, __LINE__);
+        check(rbt_set_merkle(rtree, 1) == 0, test, __LINE__);
+        check(rbt_set_multiset(ltree, 1) == -1, test, __LINE__);
+        check(rbt_set_interval(ltree, 1) == -1, test, __LINE__);
+        uint64_t lhash = 1;
+        uint64_t rhash = 2;
+        check(rbt_root_hash(ltree, &lhash) == 0 && lhash == 0, test, __LINE__);
+        check(rbt_root_hash(NULL, &lhash) == -1, test, __LINE__);
+
+        // the same set inserted in different orders gives different shapes
+        char present[SPAN31] = {0};
+        srand(Seed);
+        for (size_t i = 0; i < 800; i++) {
+                present[rand() % SPAN31] = 1;
+        }
+        for (value_t v = 0; v < SPAN31; v++) {
+                if (present[v]) {
+                        rbt_insert(ltree, v);
+                }
+        }
+        for (value_t v = SPAN31 - 1; v >= 0; v--) {
+                if (present[v]) {
+                        rbt_insert(rtree, v);
+                }
+        }
+        check(rbt_root_hash(ltree, &lhash) == 0, test, __LINE__);
+        check(rbt_root_hash(rtree, &rhash) == 0, test, __LINE__);
+        check(lhash == rhash && lhash != 0, test, __LINE__);
+        size_t lcount = 0;
+        size_t rcount = 0;
+        check(rbt_range_hash(ltree, 100, 900, &lhash, &lcount) == 0, test, __LINE__);
+        check(rbt_range_hash(rtree, 100, 900, &rhash, &rcount) == 0, test, __LINE__);
+        check(lhash == rhash && lcount == rcount, test, __LINE__);
+        size_t expected = 0;
+        for (value_t v = 100; v <= 900; v++) {
+                expected += present[v];
+        }
+        check(lcount == expected, test, __LINE__);
+
+        struct Diffs *diffs = calloc(1, sizeof(*diffs));
+        check(rbt_diff(ltree, rtree, note_diff, diffs) == 0 && diffs->count == 0,
+              test, __LINE__);
+
+        // diverge replicas on both sides and at the ends of value range
+        for (size_t i = 0; i < 30; i++) {
+                value_t val = rand() % SPAN31;
+                struct RBTree *tree = i % 2 == 0 ? ltree : rtree;
+                if (present[val]) {
+                        rbt_remove(tree, val);
+                } else {
+                        rbt_insert(tree, val);
+                }
+        }
+        check(rbt_insert(rtree, -5) == 1, test, __LINE__);
+        check(rbt_diff(ltree, rtree, note_diff, diffs) == 0, test, __LINE__);
+        size_t total = 1;
+        for (value_t v = 0; v < SPAN31; v++) {
+                int in_left = rbt_contains(ltree, v);
+                int in_right = rbt_contains(rtree, v);
+                check(diffs->side[0][v] == (in_left && !in_right), test, __LINE__);
+                check(diffs->side[1][v] == (in_right && !in_left), test, __LINE__);
+                total += in_left != in_right;
+        }
+        check(diffs->count == total, test, __LINE__);
+
+        // removing differences makes replicas equal again
+        rbt_remove(rtree, -5);
+        for (value_t v = 0; v < SPAN31; v++) {
+                if (diffs->side[0][v]) {
+                        rbt_insert(rtree, v);
+                }
+                if (diffs->side[1][v]) {
+                        rbt_remove(rtree, v);
+                }
+        }
+        check(rbt_root_hash(ltree, &lhash) == 0, test, __LINE__);
+        check(rbt_root_hash(rtree, &rhash) == 0, test, __LINE__);
+        check(lhash == rhash, test, __LINE__);
+        free(diffs);
+
+        // hashes survive split and join
+        struct RBTree *low = NULL;
+        struct RBTree *high = NULL;
+        check(rbt_split(ltree, SPAN31 / 2, &low, &high) == 0, test, __LINE__);
+        check(rbt_range_hash(rtree, INT32_MIN, SPAN31 / 2 - 1, &rhash, NULL) == 0,
+              test, __LINE__);
+        check(rbt_root_hash(low, &lhash) == 0 && lhash == rhash, test, __LINE__);
+        check(rbt_join(low, high) == 0, test, __LINE__);
+        check(rbt_root_hash(low, &lhash) == 0, test, __LINE__);
+        check(rbt_root_hash(rtree, &rhash) == 0 && lhash == rhash, test, __LINE__);
+        rbt_destruct(low);
+        rbt_destruct(rtree);
+}
+
+#define SPAN32 1000
+
+int64_t lift32(value_t val)
+{
+        return val;
+}
+
+// keeps the first of combined values, that doesn't commute
+int64_t first32(int64_t lhs, int64_t rhs)
+{
+        return lhs == INT64_MIN ? rhs : lhs;
+}
+
+int check_aggregates(struct RBTree *tree, const char *present,
+                     const struct rbt_monoid *monoid, value_t lo, value_t hi)
+{
+        int64_t expected = monoid->identity;
+        for (value_t v = 0; v < SPAN32; v++) {
+                if (v >= lo && v <= hi && present[v]) {
+                        expected = monoid->combine(expected, monoid->lift(v));
+                }
+        }
+        int64_t result = 0;
+        return rbt_range_aggregate(tree, lo, hi, &result) == 0 && result == expected;
+}
+
+void test32(int test)
+{
+        struct rbt_monoid first = {lift32, first32, INT64_MIN};
+        const struct rbt_monoid *monoids[] = {&rbt_monoid_sum, &rbt_monoid_count,
+                                              &rbt_monoid_min, &rbt_monoid_max, &first};
+        int64_t result = 0;
+        srand(Seed);
+        for (size_t m = 0; m < sizeof(monoids) / sizeof(monoids[0]); m++) {
+                struct RBTree *tree = rbt_init();
+                check(rbt_set_aggregate(tree, monoids[m]) == 0, test, __LINE__);
+                check(rbt_set_multiset(tree, 1) == -1, test, __LINE__);
+                check(rbt_set_merkle(tree, 1) == -1, test, __LINE__);
+                check(rbt_range_aggregate(tree, 0, 10, &result) == 0 &&
+                      result == monoids[m]->identity, test, __LINE__);
+                char present[SPAN32] = {0};
+                for (size_t i = 0; i < 1500; i++) {
+                        value_t val = rand() % SPAN32;
+                        if (rand() % 3 == 0) {
+                                rbt_remove(tree, val);
+                                present[val] = 0;
+                        } else {
+                                rbt_insert(tree, val);
+                                present[val] = 1;
+                        }
+                        if (i % 20 == 0) {
+                                value_t lo = rand() % (SPAN32 + 100) - 50;
+                                value_t hi = lo + rand() % 300;
+                                check(check_aggregates(tree, present, monoids[m], lo, hi),
+                                      test, __LINE__);
+                        }
+                }
+                check(check_aggregates(tree, present, monoids[m], INT32_MIN, INT32_MAX),
+                      test, __LINE__);
+                check(check_aggregates(tree, present, monoids[m], 7, 7), test, __LINE__);
+                check(check_aggregates(tree, present, monoids[m], 9, 3), test, __LINE__);
+
+                struct RBTree *low = NULL;
+                struct RBTree *high = NULL;
+                check(rbt_split(tree, SPAN32 / 3, &low, &high) == 0, test, __LINE__);
+                char low_present[SPAN32] = {0};
+                memcpy(low_present, present, SPAN32 / 3);
+                check(check_aggregates(low, low_present, monoids[m], 0, SPAN32),
+                      test, __LINE__);
+                check(rbt_remove_range(high, 400, 600, NULL) == 0, test, __LINE__);
+                memset(present + 400, 0, 201);
+                check(rbt_join(low, high) == 0, test, __LINE__);
+                for (value_t lo = -5; lo < SPAN32; lo += 37) {
+                        check(check_aggregates(low, present, monoids[m], lo, lo + 150),
+                              test, __LINE__);
+                }
+                rbt_destruct(low);
+        }
+
+        struct RBTree *sums = rbt_init();
+        struct RBTree *counts = rbt_init();
+        rbt_set_aggregate(sums, &rbt_monoid_sum);
+        rbt_set_aggregate(counts, &rbt_monoid_count);
+        check(rbt_join(sums, counts) == -1, test, __LINE__);
+        check(rbt_range_aggregate(NULL, 0, 1, &result) == -1, test, __LINE__);
+        rbt_set_aggregate(counts, NULL);
+        check(rbt_range_aggregate(counts, 0, 1, &result) == -1, test, __LINE__);
+        rbt_destruct(sums);
+        rbt_destruct(counts);
+}
+
+// exports tree in chunks of cap values starting at val and checks them against all
+int check_chunks(struct RBTree *tree, const value_t *all, size_t size,
+                 value_t val, size_t cap)
+{
+        size_t first = 0;
+        while (first < size && all[first] < val) {
+                first++;
+        }
+        struct RBCursor cursor = {NULL, NULL, 0, 0};
+        rbt_cursor_seek(tree, val, &cursor);
+        value_t *buf = calloc(cap + 1, sizeof(*buf));
+        int ok = 1;
+        size_t len = 0;
+        while ((len = rbt_export_chunk(&cursor, buf, cap)) > 0) {
+                ok = ok && len <= cap && first + len <= size &&
+                     memcmp(buf, all + first, len * sizeof(*buf)) == 0;
+                first += len;
+                value_t next = 0;
+                if (first < size) {
+                        ok = ok && len == cap && rbt_cursor_get(&cursor, &next) == 1 &&
+                             next == all[first];
+                }
+        }
+        free(buf);
+        return ok && first == size;
+}
+
+void test33(int test)
+{
+        struct RBTree *tree = rbt_init();
+        size_t N = 1000;
+        srand(Seed);
+        for (size_t i = 0; i < N; i++) {
+                rbt_insert(tree, rand() % (N * 10) - (value_t)N);
+        }
+        size_t size = rbt_get_size(tree);
+        value_t *all = calloc(size, sizeof(*all));
+        value_t *pos = all;
+        rbt_foreach(tree, collect, &pos);
+        value_t *array = calloc(size + 1, sizeof(*array));
+        check(rbt_to_array(tree, array, size + 1) == size, test, __LINE__);
+        check(memcmp(array, all, size * sizeof(*all)) == 0, test, __LINE__);
+        check(rbt_to_array(tree, array, 10) == 10, test, __LINE__);
+        check(rbt_to_array(NULL, array, 10) == 0, test, __LINE__);
+        check(rbt_export_chunk(NULL, array, 10) == 0, test, __LINE__);
+
+        size_t caps[] = {1, 7, 128, 129, 300, 2000};
+        for (int compressed = 0; compressed < 2; compressed++) {
+                for (size_t i = 0; i < sizeof(caps) / sizeof(caps[0]); i++) {
+                        check(check_chunks(tree, all, size, INT32_MIN, caps[i]),
+                              test, __LINE__);
+                        check(check_chunks(tree, all, size, all[size / 3], caps[i]),
+                              test, __LINE__);
+                        check(check_chunks(tree, all, size, all[130] + 1, caps[i]),
+                              test, __LINE__);
+                        check(check_chunks(tree, all, size, INT32_MAX, caps[i]),
+                              test, __LINE__);
+                }
+                check(rbt_compress(tree) == 0, test, __LINE__);
+        }
+        memset(array, 0, size * sizeof(*array));
+        check(rbt_to_array(tree, array, size) == size, test, __LINE__);
+        check(memcmp(array, all, size * sizeof(*all)) == 0, test, __LINE__);
+        rbt_destruct(tree);
+
+        struct RBTree *multi = rbt_init();
+        rbt_set_multiset(multi, 1);
+        rbt_insert(multi, 3);
+        rbt_insert(multi, 3);
+        rbt_insert(multi, 1);
+        check(rbt_to_array(multi, array, size) == 2, test, __LINE__);
+        check(array[0] == 1 && array[1] == 3, test, __LINE__);
+        rbt_destruct(multi);
+        free(array);
+        free(all);
+}
+
+#define SPAN34 64
+
+int check_small(struct RBTree *tree, const char *present)
+{
+        value_t all[SPAN34];
+        size_t size = 0;
+        for (value_t v = 0; v < SPAN34; v++) {
+                if (present[v]) {
+                        all[size++] = v;
+                }
+        }
+        value_t vals[SPAN34];
+        value_t *pos = vals;
+        int ok = rbt_get_size(tree) == size &&
+                 rbt_foreach(tree, collect, &pos) == 0 && pos == vals + size &&
+                 memcmp(vals, all, size * sizeof(*vals)) == 0;
+        for (value_t v = -1; v <= SPAN34; v++) {
+                int in = v >= 0 && v < SPAN34 && present[v];
+                ok = ok && rbt_contains(tree, v) == in && rbt_count(tree, v) == (size_t)in;
+        }
+        value_t min = 0;
+        value_t max = 0;
+        if (size > 0) {
+                ok = ok && rbt_min(tree, &min) == 1 && min == all[0] &&
+                     rbt_max(tree, &max) == 1 && max == all[size - 1];
+        } else {
+                ok = ok && rbt_min(tree, &min) == 0 && rbt_max(tree, &max) == 0;
+        }
+        return ok;
+}
+
+void test34(int test)
+{
+        struct RBTree *tree = rbt_init();
+        check(rbt_set_small(NULL, 8) == -1, test, __LINE__);
+        check(rbt_set_small(tree, 16) == 0, test, __LINE__);
+        char present[SPAN34] = {0};
+        srand(Seed);
+        // sizes wander across the limit and back, so set converts both ways
+        for (size_t i = 0; i < 2000; i++) {
+                value_t val = rand() % SPAN34;
+                int grow = (i / 200) % 2 == 0;
+                if (rand() % 4 < (grow ? 1 : 3)) {
+                        check(rbt_remove(tree, val) == present[val], test, __LINE__);
+                        present[val] = 0;
+                } else {
+                        check(rbt_insert(tree, val) == !present[val], test, __LINE__);
+                        present[val] = 1;
+                }
+                if (i % 10 == 0) {
+                        check(check_small(tree, present), test, __LINE__);
+                }
+        }
+        while (rbt_get_size(tree) > 5) {
+                value_t val = 0;
+                check(rbt_pop_max(tree, &val) == 1, test, __LINE__);
+                present[val] = 0;
+        }
+        value_t val = 0;
+        check(rbt_pop_min(tree, &val) == 1 && present[val], test, __LINE__);
+        present[val] = 0;
+        check(check_small(tree, present), test, __LINE__);
+
+        struct RBTree *copy = rbt_clone(tree);
+        check(copy != NULL && check_small(copy, present), test, __LINE__);
+        check(rbt_insert(copy, SPAN34 - 1) == !present[SPAN34 - 1], test, __LINE__);
+        check(check_small(tree, present), test, __LINE__);
+        rbt_destruct(copy);
+
+        value_t array[SPAN34];
+        size_t size = rbt_get_size(tree);
+        check(rbt_to_array(tree, array, SPAN34) == size, test, __LINE__);
+        // cursors and hints work on array, so it has no nodes
+        struct RBCursor cursor = {NULL, NULL, 0, 0};
+        check(rbt_cursor_seek(tree, INT32_MIN, &cursor) == (size > 0), test, __LINE__);
+        check(rbt_cursor_node(&cursor) == NULL, test, __LINE__);
+        size_t walked = 0;
+        while (rbt_cursor_get(&cursor, &val) == 1) {
+                check(walked < size && val == array[walked], test, __LINE__);
+                walked++;
+                rbt_cursor_next(&cursor);
+        }
+        check(walked == size, test, __LINE__);
+        rbt_cursor_seek(tree, INT32_MIN, &cursor);
+        check(rbt_cursor_prev(&cursor) == 0, test, __LINE__);
+        struct RBCursor hint = {NULL, NULL, 0, 0};
+        for (value_t v = 0; v < 3; v++) {
+                check(rbt_insert_hint(tree, &hint, v) == !present[v], test, __LINE__);
+                present[v] = 1;
+                check(rbt_cursor_get(&hint, &val) == 1 && val == v &&
+                      rbt_cursor_node(&hint) == NULL, test, __LINE__);
+        }
+        size = rbt_get_size(tree);
+        check(check_small(tree, present), test, __LINE__);
+        check(rbt_set_multiset(tree, 1) == (size > 0 ? -1 : 0), test, __LINE__);
+        check(rbt_set_small(tree, 0) == 0, test, __LINE__);
+        check(check_small(tree, present), test, __LINE__);
+        rbt_destruct(tree);
+
+        struct RBTree *multi = rbt_init();
+        rbt_set_multiset(multi, 1);
+        check(rbt_set_small(multi, 8) == -1, test, __LINE__);
+        rbt_destruct(multi);
+
+        // small set becomes multiset, while it is empty
+        struct RBTree *empty = rbt_init();
+        rbt_set_small(empty, 8);
+        check(rbt_set_multiset(empty, 1) == 0, test, __LINE__);
+        rbt_insert(empty, 1);
+        rbt_insert(empty, 1);
+        check(rbt_count(empty, 1) == 2, test, __LINE__);
+        rbt_destruct(empty);
+}
+
+int same_values(struct RBTree *lhs, struct RBTree *rhs)
+{
+        size_t size = rbt_get_size(lhs);
+        if (rbt_get_size(rhs) != size) {
+                return 0;
+        }
+        value_t *lvals = calloc(size + 1, sizeof(*lvals));
+        value_t *rvals = calloc(size + 1, sizeof(*rvals));
+        int same = rbt_to_array(lhs, lvals, size) == size &&
+                   rbt_to_array(rhs, rvals, size) == size &&
+                   memcmp(lvals, rvals, size * sizeof(*lvals)) == 0;
+        free(lvals);
+        free(rvals);
+        return same;
+}
+
+void test35(int test)
+{
+        const char *fname = "test35.snap";
+        struct RBTree *tree = rbt_init();
+        srand(Seed);
+        for (size_t i = 0; i < 300; i++) {
+                rbt_insert(tree, rand() % 1000);
+        }
+        check(rbt_set_durable(tree, fname, 0) == -1, test, __LINE__);
+        check(rbt_sync(tree) == -1, test, __LINE__);
+        check(rbt_set_durable(tree, fname, 16) == 0, test, __LINE__);
+        struct RBTree *copy = rbt_recover(fname);
+        check(copy != NULL && same_values(tree, copy), test, __LINE__);
+        rbt_destruct(copy);
+
+        for (size_t i = 0; i < 500; i++) {
+                value_t val = rand() % 1000;
+                if (rand() % 2 == 0) {
+                        rbt_insert(tree, val);
+                } else {
+                        rbt_remove(tree, val);
+                }
+        }
+        value_t val = 0;
+        rbt_pop_min(tree, &val);
+        rbt_pop_max(tree, &val);
+        struct RBTree *left = NULL;
+        struct RBTree *right = NULL;
+        check(rbt_split(tree, 500, &left, &right) == -1, test, __LINE__);
+        check(rbt_sync(tree) == 0, test, __LINE__);
+        copy = rbt_recover(fname);
+        check(copy != NULL && same_values(tree, copy), test, __LINE__);
+        rbt_destruct(copy);
+
+        // record torn by crash is skipped
+        FILE *log = fopen("test35.snap.log", "ab");
+        fputs("i\x01", log);
+        fclose(log);
+        copy = rbt_recover(fname);
+        check(copy != NULL && same_values(tree, copy), test, __LINE__);
+        rbt_destruct(copy);
+
+        check(rbt_checkpoint(tree) == 0, test, __LINE__);
+        log = fopen("test35.snap.log", "rb");
+        check(log != NULL && fgetc(log) == EOF, test, __LINE__);
+        fclose(log);
+        for (value_t v = 2000; v < 2100; v++) {
+                rbt_insert(tree, v);
+        }
+        // tree is closed with its log synced
+        check(rbt_set_durable(tree, NULL, 0) == 0, test, __LINE__);
+        check(rbt_insert(tree, 5000) >= 0, test, __LINE__);
+        copy = rbt_recover(fname);
+        check(copy != NULL && rbt_contains(copy, 2099) && !rbt_contains(copy, 5000),
+              test, __LINE__);
+        rbt_remove(tree, 5000);
+        check(same_values(tree, copy), test, __LINE__);
+        rbt_destruct(copy);
+        rbt_destruct(tree);
+
+        check(rbt_recover("test35.none") == NULL, test, __LINE__);
+        struct RBTree *multi = rbt_init();
+        rbt_set_multiset(multi, 1);
+        check(rbt_set_durable(multi, fname, 1) == -1, test, __LINE__);
+        rbt_destruct(multi);
+
+        /* Hand-made snapshots of ordered trees in preorder: balanced one,
+         * uneven black heights and red node with red child. */
+        const value_t vals[3][3] = {{2, 1, 3}, {2, 1, 3}, {2, 3, 4}};
+        const unsigned char flags[3][3] = {{6, 1, 1}, {6, 0, 1}, {4, 5, 1}};
+        remove("test35.snap.log");
+        for (int k = 0; k < 3; k++) {
+                FILE *snap = fopen(fname, "wb");
+                uint64_t count = 3;
+                fwrite("RBT1", 1, 4, snap);
+                fwrite(&count, sizeof(count), 1, snap);
+                for (int i = 0; i < 3; i++) {
+                        fwrite(&vals[k][i], sizeof(value_t), 1, snap);
+                        fwrite(&flags[k][i], 1, 1, snap);
+                }
+                fclose(snap);
+                copy = rbt_recover(fname);
+                check((copy != NULL) == (k == 0), test, __LINE__);
+                rbt_destruct(copy);
+        }
+        remove(fname);
+        remove("test35.snap.log");
+}
+
+void test36(int test)
+{
+        struct RBTree *tree = rbt_init();
+        struct RBTree *plain = rbt_init();
+        check(rbt_set_relaxed(NULL, 1) == -1, test, __LINE__);
+        check(rbt_rebalance(NULL, 1) == -1, test, __LINE__);
+        check(rbt_set_relaxed(tree, 1) == 0, test, __LINE__);
+        rbt_set_aggregate(tree, &rbt_monoid_sum);
+        rbt_set_aggregate(plain, &rbt_monoid_sum);
+        srand(Seed);
+        // bursts of insertions are followed by bounded rebalancing
+        for (size_t i = 0; i < 4000; i++) {
+                value_t val = rand() % 3000;
+                if (rand() % 8 == 0) {
+                        check(rbt_remove(tree, val) == rbt_remove(plain, val),
+                              test, __LINE__);
+                } else {
+                        check(rbt_insert(tree, val) == rbt_insert(plain, val),
+                              test, __LINE__);
+                }
+                check(rbt_contains(tree, val) == rbt_contains(plain, val),
+                      test, __LINE__);
+                if (i % 100 == 99) {
+                        check(rbt_rebalance(tree, 20) >= 0, test, __LINE__);
+                }
+        }
+        int64_t sum = 0;
+        int64_t plain_sum = 0;
+        rbt_range_aggregate(tree, 100, 2000, &sum);
+        rbt_range_aggregate(plain, 100, 2000, &plain_sum);
+        check(sum == plain_sum, test, __LINE__);
+        check(same_values(tree, plain), test, __LINE__);
+
+        // sorted input keeps at most two reds in a row
+        for (value_t v = 3000; v < 5000; v++) {
+                rbt_insert(tree, v);
+                rbt_insert(plain, v);
+        }
+        for (size_t i = 0; i < 200; i++) {
+                value_t val = 10000 + rand() % 10000;
+                rbt_insert(tree, val);
+                rbt_insert(plain, val);
+        }
+        // clone leaves violations of the source pending
+        check(rbt_rebalance(tree, 0) == 0, test, __LINE__);
+        struct RBTree *copy = rbt_clone(tree);
+        check(copy != NULL && same_values(copy, plain), test, __LINE__);
+        check(rbt_rebalance(tree, 0) == 0, test, __LINE__);
+        check(rbt_remove(copy, 3000) == 1 && rbt_rebalance(copy, 0) == 1,
+              test, __LINE__);
+        rbt_destruct(copy);
+        for (value_t v = 5000; v < 5100; v++) {
+                rbt_insert(tree, v);
+                rbt_insert(plain, v);
+        }
+        struct RBTree *left = NULL;
+        struct RBTree *right = NULL;
+        check(rbt_split(tree, 4000, &left, &right) == 0, test, __LINE__);
+        check(rbt_join(left, right) == 0, test, __LINE__);
+        tree = left;
+        check(same_values(tree, plain), test, __LINE__);
+        for (value_t v = 6000; v > 5100; v--) {
+                rbt_insert(tree, v);
+                rbt_insert(plain, v);
+        }
+        while (rbt_rebalance(tree, 10) == 0) {
+                continue;
+        }
+        check(rbt_set_relaxed(tree, 0) == 0, test, __LINE__);
+        check(rbt_rebalance(tree, 0) == 1, test, __LINE__);
+        check(same_values(tree, plain), test, __LINE__);
+        rbt_destruct(tree);
+        rbt_destruct(plain);
+}
+
 int main(int argc, char **argv)
 {
         if (argc > 1) {
@@ -272,6 +1920,29 @@ int main(int argc, char **argv)
         test11(11);
         test12(12);
         test13(13);
+        test14(14);
+        test15(15);
+        test16(16);
+        test17(17);
+        test18(18);
+        test19(19);
+        test20(20);
+        test21(21);
+        test22(22);
+        test23(23);
+        test24(24);
+        test25(25);
+        test26(26);
+        test27(27);
+        test28(28);
+        test29(29);
+        test30(30);
+        test31(31);
+        test32(32);
+        test33(33);
+        test34(34);
+        test35(35);
+        test36(36);
         return 0;
 }
 
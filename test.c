@@ -2,20 +2,62 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
 #include "RBTree.h"
 
 /* Query language:
  * ./test.out {[r, f, d] number}
  * r - remove number
  * f - find number
- * d - dump to file <number>.dot */
+ * d - dump to file <number>.dot
+ *
+ * Streaming mode:
+ * ./test.out -s [file] - text commands, one per line: [i, r, f, d] number,
+ *                        plain number means insert
+ * ./test.out -b [file] - binary records: 1 byte of op ('i', 'r', 'f', 'd')
+ *                        followed by 4 byte native endian int32
+ * Commands are read from file or stdin, if file is "-" or omitted.
+ * Aggregate results and timings are printed instead of per-op lines.
+ *
+ * ./test.out -g count [seed] - write count random binary records to stdout:
+ *                              half inserts, quarter removals and finds */
 
-enum ArgType {ERR, NUM, RM, FIND, DUMP};
+enum ArgType {ERR, NUM, RM, FIND, DUMP, INS};
+
+enum {STREAM_BUF_SIZE = 1 << 16, BIN_OP_SIZE = 5};
+
+struct Reader {
+        FILE *file;
+        unsigned char buf[STREAM_BUF_SIZE];
+        size_t pos;
+        size_t len;
+};
+
+struct Stats {
+        size_t ops[INS + 1];
+        size_t hits[INS + 1];
+        size_t errors;
+};
 
 static enum ArgType get_arg(const char *argi, int *num);
+static int stream(const char *mode, const char *path);
+static int reader_fill(struct Reader *rd);
+static int read_text(struct Reader *rd, enum ArgType *op, int *num);
+static int read_binary(struct Reader *rd, enum ArgType *op, int *num);
+static int apply(struct RBTree *tree, enum ArgType op, int num);
+static double elapsed(const struct timespec *start);
+static int generate(const char *count, const char *seed);
 
 int main(int argc, char **argv)
 {
+        if (argc > 2 && strcmp(argv[1], "-g") == 0) {
+                return generate(argv[2], argc > 3 ? argv[3] : "1");
+        }
+        if (argc > 1 && (strcmp(argv[1], "-s") == 0 || strcmp(argv[1], "-b") == 0)) {
+                return stream(argv[1], argc > 2 ? argv[2] : "-");
+        }
         struct RBTree *tree = rbt_init();
         for (int i = 1; i < argc; i++) {
                 int num = 0;
@@ -40,11 +82,9 @@ int main(int argc, char **argv)
                                 printf("find(%d) = %d\n", num, retcode);
                                 break;
                         case DUMP: {
-                                #ifndef NDEBUG
-                                        char fname[sizeof(num) * 2 + 5];
-                                        sprintf(fname, "%x.dot", num);
-                                        rbt_dump(tree, fname);
-                                #endif
+                                char fname[sizeof(num) * 2 + 5];
+                                sprintf(fname, "%x.dot", num);
+                                rbt_dump(tree, fname);
                                 break;
                         }
                         default:
@@ -94,3 +134,216 @@ static enum ArgType get_arg(const char *argi, int *num)
         *num = (int)lnum;
         return NUM;
 }
+
+static int stream(const char *mode, const char *path)
+{
+        static struct Reader rd;
+        int binary = mode[1] == 'b';
+        rd.file = stdin;
+        if (strcmp(path, "-") != 0) {
+                rd.file = fopen(path, binary ? "rb" : "r");
+                if (rd.file == NULL) {
+                        perror(path);
+                        return 1;
+                }
+        }
+        struct RBTree *tree = rbt_init();
+        if (tree == NULL) {
+                fprintf(stderr, "Tree allocation failed\n");
+                return 1;
+        }
+        struct Stats stats = {0};
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        enum ArgType op = ERR;
+        int num = 0;
+        int retcode = 0;
+        while ((retcode = binary ? read_binary(&rd, &op, &num)
+                                 : read_text(&rd, &op, &num)) > 0) {
+                if (op == ERR) {
+                        stats.errors++;
+                        continue;
+                }
+                int res = apply(tree, op, num);
+                stats.ops[op]++;
+                if (res == -1) {
+                        stats.errors++;
+                } else if (res > 0) {
+                        stats.hits[op]++;
+                }
+        }
+        double seconds = elapsed(&start);
+        if (retcode < 0) {
+                fprintf(stderr, "Truncated or unreadable input\n");
+                stats.errors++;
+        }
+
+        size_t total = stats.ops[INS] + stats.ops[RM] + stats.ops[FIND] + stats.ops[DUMP];
+        printf("insert: %zu ops, %zu inserted\n", stats.ops[INS], stats.hits[INS]);
+        printf("remove: %zu ops, %zu removed\n", stats.ops[RM], stats.hits[RM]);
+        printf("find:   %zu ops, %zu found\n", stats.ops[FIND], stats.hits[FIND]);
+        printf("dump:   %zu ops\n", stats.ops[DUMP]);
+        printf("errors: %zu\n", stats.errors);
+        printf("size:   %zu\n", rbt_get_size(tree));
+        printf("time:   %.3f s, %.0f ops/s\n", seconds,
+               seconds > 0 ? total / seconds : 0.0);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        rbt_destruct(tree);
+        printf("destruct: %.3f s\n", elapsed(&start));
+        if (rd.file != stdin) {
+                fclose(rd.file);
+        }
+        return stats.errors != 0;
+}
+
+/* Moves unread bytes to the beginning of buffer and reads more.
+ * Returns number of bytes available. */
+static int reader_fill(struct Reader *rd)
+{
+        size_t rest = rd->len - rd->pos;
+        memmove(rd->buf, rd->buf + rd->pos, rest);
+        rd->pos = 0;
+        rd->len = rest + fread(rd->buf + rest, 1, sizeof(rd->buf) - rest, rd->file);
+        return (int)rd->len;
+}
+
+/* Returns 1 if command is read, 0 on end of input, -1 on read error.
+ * Malformed lines are reported as ERR. */
+static int read_text(struct Reader *rd, enum ArgType *op, int *num)
+{
+        char line[64];
+        size_t len = 0;
+        int eof = 0;
+        for (;;) {
+                if (rd->pos == rd->len && reader_fill(rd) == 0) {
+                        eof = 1;
+                        break;
+                }
+                char c = (char)rd->buf[rd->pos++];
+                if (c == '\n') {
+                        if (len == 0) {
+                                continue;
+                        }
+                        break;
+                }
+                if (len < sizeof(line) - 1) {
+                        line[len] = c;
+                }
+                len++;
+        }
+        if (ferror(rd->file)) {
+                return -1;
+        }
+        if (eof && len == 0) {
+                return 0;
+        }
+        if (len >= sizeof(line)) {
+                *op = ERR;
+                return 1;
+        }
+        line[len] = '\0';
+
+        char *arg = line;
+        *op = INS;
+        if (line[0] == 'i' || line[0] == 'r' || line[0] == 'f' || line[0] == 'd') {
+                *op = line[0] == 'i' ? INS : get_arg(line, num);
+                arg++;
+                while (*arg == ' ' || *arg == '\t') {
+                        arg++;
+                }
+        }
+        if (*arg == '\0' || get_arg(arg, num) != NUM) {
+                *op = ERR;
+        }
+        return 1;
+}
+
+/* Returns 1 if command is read, 0 on end of input, -1 on truncated
+ * record or read error. */
+static int read_binary(struct Reader *rd, enum ArgType *op, int *num)
+{
+        if (rd->len - rd->pos < BIN_OP_SIZE && reader_fill(rd) < BIN_OP_SIZE) {
+                return (rd->len == 0 && !ferror(rd->file)) ? 0 : -1;
+        }
+        const unsigned char *rec = rd->buf + rd->pos;
+        rd->pos += BIN_OP_SIZE;
+        int32_t val = 0;
+        memcpy(&val, rec + 1, sizeof(val));
+        *num = val;
+        switch (rec[0])
+        {
+        case 'i':
+                *op = INS;
+                break;
+        case 'r':
+                *op = RM;
+                break;
+        case 'f':
+                *op = FIND;
+                break;
+        case 'd':
+                *op = DUMP;
+                break;
+        default:
+                *op = ERR;
+                break;
+        }
+        return 1;
+}
+
+static int apply(struct RBTree *tree, enum ArgType op, int num)
+{
+        switch (op)
+        {
+        case INS:
+                return rbt_insert(tree, num);
+        case RM:
+                return rbt_remove(tree, num);
+        case FIND:
+                return rbt_contains(tree, num);
+        case DUMP: {
+                char fname[sizeof(num) * 2 + 5];
+                sprintf(fname, "%x.dot", num);
+                rbt_dump(tree, fname);
+                return 0;
+        }
+        default:
+                return -1;
+        }
+}
+
+static double elapsed(const struct timespec *start)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (double)(now.tv_sec - start->tv_sec) +
+               (double)(now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+static int generate(const char *count, const char *seed)
+{
+        int num = 0;
+        if (get_arg(count, &num) != NUM || num < 0) {
+                return 1;
+        }
+        size_t ops = (size_t)num;
+        if (get_arg(seed, &num) != NUM) {
+                return 1;
+        }
+        srand((unsigned)num);
+        // values are drawn from range, where about half of inserts hit
+        int range = ops > 2 ? (int)(ops / 2) : 1;
+        unsigned char rec[BIN_OP_SIZE];
+        for (size_t i = 0; i < ops; i++) {
+                int kind = rand() % 4;
+                rec[0] = kind < 2 ? 'i' : (kind == 2 ? 'r' : 'f');
+                int32_t val = rand() % range;
+                memcpy(rec + 1, &val, sizeof(val));
+                if (fwrite(rec, 1, sizeof(rec), stdout) != sizeof(rec)) {
+                        return 1;
+                }
+        }
+        return fflush(stdout) != 0;
+}